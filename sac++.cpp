@@ -39,11 +39,22 @@
 #include <sstream>
 #include <iomanip>
 #include <deque>
+#include <unordered_map>
+#include <map>
+#include <cstdint>
+#include <climits>
+#include <cerrno>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <regex>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <conio.h>
 #include <io.h>
+#include <direct.h>
+#include <sys/stat.h>
 #else
 #include <termios.h>
 #include <unistd.h>
@@ -51,23 +62,1274 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
 #endif
 
 #define MAX_LINE_LENGTH 34600
 #define MAX_UNDO_STACK 50
+#define INDEX_MIN_SIZE (16 * 1024 * 1024)
+#define INDEX_STRIDE 4096
+#define INDEX_SAMPLE 32
+#define CHUNK_MIN 4096
+#define CHUNK_MAX 262144
+#define BRACKET_BLOCK 64
+#define SESSION_VERSION 1
+#define SESSION_IDLE 2000
+#define MEMORY_TRIM 90
+#define SEARCH_MAX_HITS 10000
+#define BINARY_SNIFF 8000
+#define HEX_WIDTH 16
 #define STATUS_LINE "\033[1;34m[Ctrl+G: Guide / Ctrl+N: Credits | Line: %d Col: %d | %s]\033[0m"
+#define HEX_STATUS "\033[1;34m[Ctrl+G: Guide / Ctrl+N: Credits | Offset: 0x%zx of %zu | %s]\033[0m"
+
+enum MemCategory { MEM_TEXT, MEM_UNDO, MEM_CLIPBOARD, MEM_DISPLAY, MEM_CACHE, MEM_CATEGORIES };
+
+static const char* const mem_names[MEM_CATEGORIES] = {"Text", "Undo history", "Clipboard", "Display", "Caches"};
+static std::atomic<int64_t> mem_used[MEM_CATEGORIES];
+static std::atomic<int64_t> mem_peak[MEM_CATEGORIES];
+
+static void mem_track(int category, int64_t bytes) {
+    int64_t now = mem_used[category] += bytes;
+    int64_t peak = mem_peak[category];
+    while (now > peak && !mem_peak[category].compare_exchange_weak(peak, now)) {}
+}
+
+static int64_t mem_total() {
+    int64_t total = 0;
+    for (int i = 0; i < MEM_CATEGORIES; i++) total += mem_used[i];
+    return total;
+}
+
+template <typename T, int C>
+struct Counted {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef Counted<U, C> other; };
+    
+    Counted() {}
+    template <typename U> Counted(const Counted<U, C>&) {}
+    
+    T* allocate(size_t n) {
+        T* p = std::allocator<T>().allocate(n);
+        mem_track(C, (int64_t)(n * sizeof(T)));
+        return p;
+    }
+    
+    void deallocate(T* p, size_t n) {
+        mem_track(C, -(int64_t)(n * sizeof(T)));
+        std::allocator<T>().deallocate(p, n);
+    }
+    
+    bool operator==(const Counted&) const { return true; }
+    bool operator!=(const Counted&) const { return false; }
+};
+
+template <typename T, int C> using CountedVector = std::vector<T, Counted<T, C>>;
+
+struct BracketSum {
+    int sum, minpre;
+    
+    BracketSum() : sum(0), minpre(0) {}
+    int maxsuf() const { return sum - minpre; }
+    
+    static BracketSum join(const BracketSum& a, const BracketSum& b) {
+        BracketSum r;
+        r.sum = a.sum + b.sum;
+        r.minpre = std::min(a.minpre, a.sum + b.minpre);
+        return r;
+    }
+};
+
+static size_t bom_length(const char* data, size_t len) {
+    return len >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0 ? 3 : 0;
+}
+
+static bool gzip_magic(const char* data, size_t len) {
+    return len >= 2 && (uint8_t)data[0] == 0x1f && (uint8_t)data[1] == 0x8b;
+}
+
+static uint64_t line_hash(const char* data, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, data + i, len - i);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h ? h : 1;
+}
+
+struct LineCache {
+    int8_t lex_in;
+    uint8_t lex_out;
+    BracketSum brackets;
+    uint64_t hash;
+    
+    LineCache() : lex_in(-1), lex_out(0), hash(0) {}
+};
+
+enum LineMark { MARK_CHANGED = 1, MARK_ADDED = 2, MARK_REMOVED = 4 };
+
+class Line {
+    struct Node {
+        std::string text;
+        LineCache cache;
+        size_t counted;
+        
+        Node() : counted(0) {}
+        Node(std::string s) : text(std::move(s)), counted(0) { settle(); }
+        ~Node() { mem_track(MEM_TEXT, -(int64_t)counted); }
+        
+        void settle() {
+            size_t bytes = text.capacity() > 15 ? text.capacity() + 1 : 0;
+            mem_track(MEM_TEXT, (int64_t)bytes - (int64_t)counted);
+            counted = bytes;
+        }
+    };
+    std::shared_ptr<Node> node;
+    int fold;
+    uint8_t mark;
+    
+    static std::shared_ptr<Node> make(std::string s) {
+        return std::allocate_shared<Node>(Counted<Node, MEM_TEXT>(), std::move(s));
+    }
+    
+    static const std::shared_ptr<Node>& blank() {
+        static const std::shared_ptr<Node> empty = make(std::string());
+        return empty;
+    }
+    
+public:
+    Line() : node(blank()), fold(0), mark(0) {}
+    Line(const char* s) : node(make(s)), fold(0), mark(0) {}
+    Line(std::string s) : node(make(std::move(s))), fold(0), mark(0) {}
+    
+    const std::string& str() const { return node->text; }
+    operator const std::string&() const { return node->text; }
+    size_t length() const { return node->text.length(); }
+    size_t size() const { return node->text.size(); }
+    bool empty() const { return node->text.empty(); }
+    char operator[](size_t i) const { return node->text[i]; }
+    LineCache& cache() const { return node->cache; }
+    bool same(const Line& other) const { return node == other.node; }
+    const void* id() const { return node.get(); }
+    int folded() const { return fold; }
+    
+    uint64_t hash() const {
+        if (!node->cache.hash) node->cache.hash = line_hash(node->text.data(), node->text.size());
+        return node->cache.hash;
+    }
+    void set_fold(int n) { fold = n; }
+    int marks() const { return mark; }
+    void set_marks(int m) { mark = m; }
+    
+    void settle() const { node->settle(); }
+    
+    std::string& mut() {
+        if (node.use_count() > 1) node = make(node->text);
+        else {
+            node->settle();
+            node->cache = LineCache();
+        }
+        return node->text;
+    }
+};
+
+typedef CountedVector<Line, MEM_TEXT> Lines;
+typedef CountedVector<Line, MEM_UNDO> UndoLines;
+
+struct EditorState {
+    UndoLines lines;
+    int cursor_x, cursor_y;
+    size_t keep_head, keep_tail;
+    
+    EditorState() : cursor_x(0), cursor_y(0), keep_head(SIZE_MAX), keep_tail(0) {}
+    EditorState(const Lines& l, int x, int y) : lines(l.begin(), l.end()), cursor_x(x), cursor_y(y), keep_head(SIZE_MAX), keep_tail(0) {}
+};
+
+struct Clip {
+    CountedVector<Line, MEM_CLIPBOARD> lines;
+    size_t head, tail;
+    bool whole_lines;
+    
+    Clip() : head(0), tail(0), whole_lines(false) {}
+};
+
+struct LineIndex {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t line_count;
+    uint64_t tail_sample;
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> samples;
+    
+    LineIndex() : size(0), mtime(0), line_count(0), tail_sample(0) {}
+};
+
+struct DiskHunk {
+    size_t old_start, old_end;
+    size_t new_start, new_end;
+};
+
+struct DiskChunk {
+    uint64_t hash;
+    size_t lines;
+    
+    bool operator==(const DiskChunk& other) const { return hash == other.hash && lines == other.lines; }
+};
+
+typedef CountedVector<DiskChunk, MEM_CACHE> DiskChunks;
+
+static uint64_t fnv1a(const char* data, size_t len, uint64_t h = 1469598103934665603ULL) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void put_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += (char)(v | 0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+static bool get_varint(const std::string& in, size_t& pos, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+        unsigned char b = in[pos++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static void put_text(std::string& out, const std::string& text) {
+    put_varint(out, text.size());
+    out += text;
+}
+
+static bool get_text(const std::string& in, size_t& pos, std::string& text) {
+    uint64_t len;
+    if (!get_varint(in, pos, len) || len > in.size() - pos) return false;
+    text.assign(in, pos, len);
+    pos += len;
+    return true;
+}
+
+struct DiffRun {
+    int a, b, len;
+};
+
+static void diff_hashes(const uint64_t* a, int n, const uint64_t* b, int m, int a0, int b0, std::vector<int>& v, std::vector<DiffRun>& runs);
+
+static bool diff_split(const uint64_t* a, int n, const uint64_t* b, int m, std::vector<int>& v, int& sx, int& sy) {
+    int max_d = (n + m + 1) / 2, off = max_d, len = 2 * max_d + 2, delta = n - m;
+    bool front = delta & 1;
+    v.assign(2 * len, -1);
+    int* v1 = v.data();
+    int* v2 = v.data() + len;
+    v1[off + 1] = v2[off + 1] = 0;
+    int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+    for (int d = 0; d < max_d; d++) {
+        for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+            int x1 = k1 == -d || (k1 != d && v1[off + k1 - 1] < v1[off + k1 + 1]) ? v1[off + k1 + 1] : v1[off + k1 - 1] + 1;
+            int y1 = x1 - k1;
+            while (x1 < n && y1 < m && a[x1] == b[y1]) {
+                x1++;
+                y1++;
+            }
+            v1[off + k1] = x1;
+            if (x1 > n) k1end += 2;
+            else if (y1 > m) k1start += 2;
+            else if (front) {
+                int k2 = off + delta - k1;
+                if (k2 >= 0 && k2 < len && v2[k2] != -1 && x1 >= n - v2[k2]) {
+                    sx = x1;
+                    sy = y1;
+                    return true;
+                }
+            }
+        }
+        for (int k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+            int x2 = k2 == -d || (k2 != d && v2[off + k2 - 1] < v2[off + k2 + 1]) ? v2[off + k2 + 1] : v2[off + k2 - 1] + 1;
+            int y2 = x2 - k2;
+            while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+                x2++;
+                y2++;
+            }
+            v2[off + k2] = x2;
+            if (x2 > n) k2end += 2;
+            else if (y2 > m) k2start += 2;
+            else if (!front) {
+                int k1 = off + delta - k2;
+                if (k1 >= 0 && k1 < len && v1[k1] != -1 && v1[k1] >= n - x2) {
+                    sx = v1[k1];
+                    sy = off + sx - k1;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+static void diff_hashes(const uint64_t* a, int n, const uint64_t* b, int m, int a0, int b0, std::vector<int>& v, std::vector<DiffRun>& runs) {
+    int head = 0, tail = 0;
+    while (head < n && head < m && a[head] == b[head]) head++;
+    while (tail < n - head && tail < m - head && a[n - 1 - tail] == b[m - 1 - tail]) tail++;
+    if (head) runs.push_back({a0, b0, head});
+    int n2 = n - head - tail, m2 = m - head - tail, sx, sy;
+    if (n2 > 0 && m2 > 0 && diff_split(a + head, n2, b + head, m2, v, sx, sy)) {
+        diff_hashes(a + head, sx, b + head, sy, a0 + head, b0 + head, v, runs);
+        diff_hashes(a + head + sx, n2 - sx, b + head + sy, m2 - sy, a0 + head + sx, b0 + head + sy, v, runs);
+    }
+    if (tail) runs.push_back({a0 + n - tail, b0 + m - tail, tail});
+}
+
+static DiskChunks chunk_lines(const Lines& src, size_t from = 0) {
+    DiskChunks chunks;
+    DiskChunk chunk = {1469598103934665603ULL, 0};
+    size_t bytes = 0;
+    for (size_t i = from; i < src.size(); i++) {
+        uint64_t h = src[i].hash();
+        chunk.hash = (chunk.hash ^ h) * 1099511628211ULL;
+        chunk.lines++;
+        bytes += src[i].size() + 1;
+        if ((bytes >= CHUNK_MIN && (h & 31) == 0) || bytes >= CHUNK_MAX) {
+            chunks.push_back(chunk);
+            chunk = {1469598103934665603ULL, 0};
+            bytes = 0;
+        }
+    }
+    if (chunk.lines > 0) chunks.push_back(chunk);
+    return chunks;
+}
+
+template <typename F>
+static void parallel_for(size_t tasks, F task) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t t = next++; t < tasks; t = next++) task(t);
+    };
+    unsigned int nthreads = std::max(1u, std::min<unsigned int>(std::thread::hardware_concurrency(), tasks));
+    std::vector<std::thread> pool;
+    for (unsigned int t = 1; t < nthreads; t++) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+}
+
+template <typename T, typename Less>
+static void parallel_sort(std::vector<T>& items, Less less) {
+    size_t parts = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), items.size() / 65536 + 1);
+    std::vector<size_t> bounds;
+    for (size_t p = 0; p <= parts; p++) bounds.push_back(items.size() * p / parts);
+    parallel_for(parts, [&](size_t p) {
+        std::sort(items.begin() + bounds[p], items.begin() + bounds[p + 1], less);
+    });
+    for (size_t width = 1; width < parts; width *= 2) {
+        parallel_for((parts + 2 * width - 1) / (2 * width), [&](size_t k) {
+            size_t lo = 2 * width * k, mid = std::min(lo + width, parts), hi = std::min(lo + 2 * width, parts);
+            if (mid < hi) std::inplace_merge(items.begin() + bounds[lo], items.begin() + bounds[mid], items.begin() + bounds[hi], less);
+        });
+    }
+}
+
+struct SortKey {
+    uint64_t prefix;
+    const char* text;
+    uint32_t len, index;
+    double num;
+};
+
+static SortKey sort_key(const std::string& line, uint32_t index, int column, bool numeric) {
+    size_t at = 0;
+    for (int field = 1; field < column; field++) {
+        while (at < line.size() && isspace((unsigned char)line[at])) at++;
+        while (at < line.size() && !isspace((unsigned char)line[at])) at++;
+    }
+    if (column > 1 || numeric) {
+        while (at < line.size() && isspace((unsigned char)line[at])) at++;
+    }
+    SortKey key = {0, line.c_str() + at, (uint32_t)(line.size() - at), index, 0};
+    for (size_t i = 0; i < 8; i++) key.prefix = key.prefix << 8 | (i < key.len ? (unsigned char)key.text[i] : 0);
+    if (numeric) {
+        key.num = strtod(key.text, nullptr);
+        if (key.num != key.num) key.num = 0;
+    }
+    return key;
+}
+
+static int compare_keys(const SortKey& a, const SortKey& b, bool numeric) {
+    if (numeric && a.num != b.num) return a.num < b.num ? -1 : 1;
+    if (a.prefix != b.prefix) return a.prefix < b.prefix ? -1 : 1;
+    int c = memcmp(a.text, b.text, std::min(a.len, b.len));
+    if (c) return c;
+    return a.len < b.len ? -1 : a.len > b.len;
+}
+
+enum WordClass { WORD_NONE, WORD_KEYWORD, WORD_TYPE, WORD_CONSTANT, WORD_BUILTIN };
+
+struct GrammarSpec {
+    const char* name;
+    const char* extensions;
+    const char* shebang;
+    const char* line_comment;
+    bool block_comment, directives, char_quotes, backtick, regex, angle, lisp_words, fold_case, bang_macros;
+    const char* keywords;
+    const char* types;
+    const char* constants;
+    const char* builtins;
+};
+
+static const GrammarSpec grammar_specs[] = {
+    {"C/C++", "c h cc cpp cxx hpp hh hxx ino m mm", "", "//", true, true, true, false, false, true, false, false, false,
+     "if else for while do switch case default break continue return void int char float double long short bool "
+     "true false const static extern auto register volatile signed unsigned mutable struct union enum typedef class "
+     "public private protected operator virtual inline friend template typename namespace using this new delete try "
+     "catch throw nullptr override final constexpr decltype noexcept goto",
+     "std::string std::vector std::map std::set std::pair std::unique_ptr std::shared_ptr std::weak_ptr std::array "
+     "std::deque std::list std::queue std::stack std::priority_queue std::unordered_map std::unordered_set size_t "
+     "uint8_t uint16_t uint32_t uint64_t int8_t int16_t int32_t int64_t wchar_t char16_t char32_t ptrdiff_t intptr_t "
+     "uintptr_t string",
+     "NULL TRUE FALSE nullptr true false stdout stderr stdin EOF EXIT_SUCCESS EXIT_FAILURE RAND_MAX CLOCKS_PER_SEC "
+     "CHAR_BIT CHAR_MAX CHAR_MIN INT_MAX INT_MIN LONG_MAX LONG_MIN SHRT_MAX SHRT_MIN UCHAR_MAX UINT_MAX ULONG_MAX "
+     "USHRT_MAX FLT_MAX FLT_MIN DBL_MAX DBL_MIN",
+     "printf scanf malloc free sizeof strlen strcpy strcat strcmp memcpy memset memmove abs fabs sqrt pow sin cos tan "
+     "log exp ceil floor round min max swap sort reverse"},
+    {"JavaScript", "js mjs cjs jsx ts tsx", "node deno", "//", true, false, true, true, true, true, false, false, false,
+     "if else for while do switch case default break continue return function var let const async await import "
+     "export from as class new delete this try catch finally throw typeof instanceof extends implements interface "
+     "super yield in of static",
+     "String Array Object Number Boolean Symbol BigInt Promise RegExp Date Error Map Set WeakMap WeakSet",
+     "true false null undefined NaN Infinity Math PI E SQRT2 LN2 LOG2E MAX_VALUE MIN_VALUE POSITIVE_INFINITY "
+     "NEGATIVE_INFINITY MAX_SAFE_INTEGER MIN_SAFE_INTEGER EPSILON",
+     "require module exports process console window document prototype constructor"},
+    {"Python", "py pyw pyi", "python", "#", false, false, true, false, false, false, false, false, false,
+     "if elif else for while break continue return def class self import from as lambda yield with global nonlocal "
+     "pass raise assert del is in not and or try except finally async await",
+     "list dict tuple set frozenset bytearray bytes memoryview slice int float str bool",
+     "None True False",
+     "print input len range enumerate zip map filter reduce sorted reversed sum any all min max abs round pow divmod "
+     "bin oct hex ord chr type isinstance issubclass hasattr getattr setattr delattr dir vars globals locals eval "
+     "exec compile open super"},
+    {"Go", "go", "", "//", true, false, true, true, false, false, false, false, false,
+     "package import func go defer chan select interface type var const struct map range return if else for switch "
+     "case default break continue fallthrough goto",
+     "int int8 int16 int32 int64 uint uint8 uint16 uint32 uint64 uintptr float32 float64 complex64 complex128 string "
+     "byte rune bool error",
+     "true false nil iota",
+     "make len cap append copy close delete new panic recover print println fmt Println Printf Sprintf"},
+    {"Java", "java kt kts scala groovy", "", "//", true, false, true, false, false, true, false, false, false,
+     "public private protected static final abstract class interface extends implements new return if else for "
+     "while do switch case default break continue try catch finally throw throws this super void synchronized "
+     "native package import instanceof enum",
+     "int long short byte char float double boolean String Integer Double Float Long Short Byte Character Boolean "
+     "Object ArrayList HashMap HashSet LinkedList Stack Queue Vector TreeMap List Map Set",
+     "true false null",
+     "System out err in println print printf Scanner BufferedReader FileReader FileWriter Collections Arrays Math "
+     "Random"},
+    {"Rust", "rs", "", "//", true, false, true, false, false, true, false, false, true,
+     "fn let mut match impl trait mod use crate pub where struct enum if else for while loop return break continue "
+     "as in ref self Self static const unsafe async await move dyn type",
+     "i8 i16 i32 i64 i128 u8 u16 u32 u64 u128 f32 f64 usize isize str bool char String Vec Box Rc Arc Cell RefCell "
+     "HashMap BTreeMap Option Result",
+     "Some None Ok Err true false",
+     "println! print! format! panic! assert! debug_assert! vec! macro_rules! include! include_str! include_bytes! "
+     "env! option_env! concat! stringify! line! column! file! module_path! cfg!"},
+    {"Lisp", "lisp lsp el cl scm ss rkt clj cljs edn", "sbcl guile racket", ";", false, false, false, false, false, false, true, false, false,
+     "defun defmacro defvar defparameter defstruct defn def let let* lambda fn if unless when cond case progn begin "
+     "define set! setq quote unquote splice gensym eval apply loop do",
+     "",
+     "nil t #t #f",
+     "car cdr cons list append mapcar map filter reduce format first rest"},
+    {"SQL", "sql", "", "--", true, false, true, true, false, false, false, true, false,
+     "SELECT FROM WHERE JOIN INNER LEFT RIGHT FULL OUTER ON INSERT INTO VALUES UPDATE SET DELETE CREATE ALTER DROP "
+     "TABLE DATABASE INDEX PRIMARY KEY FOREIGN REFERENCES UNIQUE NOT DEFAULT CHECK GRANT REVOKE COMMIT ROLLBACK "
+     "TRANSACTION BEGIN END DECLARE PROCEDURE FUNCTION TRIGGER VIEW CURSOR LOOP WHILE FOR IF AND OR AS ORDER BY "
+     "GROUP HAVING LIMIT DISTINCT UNION CASE WHEN THEN ELSE IS IN LIKE BETWEEN",
+     "INT INTEGER BIGINT SMALLINT VARCHAR CHAR TEXT BLOB REAL FLOAT NUMERIC DECIMAL BOOLEAN DATE TIME TIMESTAMP "
+     "DATETIME YEAR BINARY VARBINARY ENUM JSON XML UUID SERIAL BIGSERIAL SMALLSERIAL MONEY INET CIDR",
+     "NULL TRUE FALSE",
+     "COUNT SUM AVG MIN MAX COALESCE NOW"},
+    {"Shell", "sh bash zsh ksh", "sh bash zsh ksh dash", "#", false, false, true, true, false, false, false, false, false,
+     "if then else elif fi for while until do done case esac in function return local export readonly declare "
+     "break continue select",
+     "",
+     "true false",
+     "echo printf read cd exit set unset source test eval exec shift trap alias"},
+};
+
+#define GRAMMAR_GENERIC (sizeof(grammar_specs) / sizeof(grammar_specs[0]))
+
+static const GrammarSpec generic_spec = {
+    "Generic", "", "", "//", true, true, true, true, true, true, false, false, false, "", "", "", ""
+};
+
+class Grammar {
+    std::string blob;
+    std::vector<uint32_t> slots;
+    uint32_t mask;
+    
+    static uint64_t hash_word(const char* word, size_t len, bool fold) {
+        uint64_t h = 1469598103934665603ULL;
+        for (size_t i = 0; i < len; i++) {
+            h ^= (unsigned char)(fold ? std::toupper((unsigned char)word[i]) : word[i]);
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+    
+    void add_words(const char* list, int cls) {
+        const char* p = list;
+        while (*p) {
+            while (*p == ' ') p++;
+            const char* end = p;
+            while (*end && *end != ' ') end++;
+            if (end > p && lookup(p, end - p) == WORD_NONE) {
+                uint32_t slot = hash_word(p, end - p, spec->fold_case) & mask;
+                while (slots[slot]) slot = (slot + 1) & mask;
+                slots[slot] = ((uint32_t)blob.size() << 12) | ((uint32_t)(end - p) << 4) | cls;
+                blob.append(p, end - p);
+            }
+            p = end;
+        }
+    }
+    
+    Grammar(const GrammarSpec* s, const GrammarSpec* sources, size_t count) : mask(0), spec(s) {
+        size_t words = 0;
+        for (size_t i = 0; i < count; i++) {
+            for (const char* list : {sources[i].keywords, sources[i].types, sources[i].constants, sources[i].builtins}) {
+                for (const char* p = list; *p; p++) words += *p == ' ';
+                words++;
+            }
+        }
+        uint32_t size = 16;
+        while (size < words * 2) size <<= 1;
+        slots.assign(size, 0);
+        mask = size - 1;
+        for (int cls = WORD_KEYWORD; cls <= WORD_BUILTIN; cls++) {
+            for (size_t i = 0; i < count; i++) {
+                const GrammarSpec& src = sources[i];
+                add_words(cls == WORD_KEYWORD ? src.keywords : cls == WORD_TYPE ? src.types :
+                          cls == WORD_CONSTANT ? src.constants : src.builtins, cls);
+            }
+        }
+        blob.shrink_to_fit();
+    }
+    
+public:
+    const GrammarSpec* spec;
+    
+    int lookup(const char* word, size_t len) const {
+        if (len == 0 || len > 255) return WORD_NONE;
+        for (uint32_t slot = hash_word(word, len, spec->fold_case) & mask; slots[slot]; slot = (slot + 1) & mask) {
+            uint32_t entry = slots[slot];
+            if (((entry >> 4) & 0xff) != len) continue;
+            const char* candidate = blob.data() + (entry >> 12);
+            bool same = true;
+            for (size_t i = 0; i < len && same; i++) {
+                same = spec->fold_case ? std::toupper((unsigned char)word[i]) == candidate[i] : word[i] == candidate[i];
+            }
+            if (same) return entry & 0xf;
+        }
+        return WORD_NONE;
+    }
+    
+    static const Grammar* load(size_t index) {
+        static std::unique_ptr<Grammar> cache[GRAMMAR_GENERIC + 1];
+        if (!cache[index]) {
+            if (index == GRAMMAR_GENERIC) {
+                cache[index].reset(new Grammar(&generic_spec, grammar_specs, GRAMMAR_GENERIC));
+            } else {
+                cache[index].reset(new Grammar(&grammar_specs[index], &grammar_specs[index], 1));
+            }
+        }
+        return cache[index].get();
+    }
+    
+    static const Grammar* for_file(const std::string& fname, const std::string& first_line) {
+        size_t slash = fname.find_last_of("/\\");
+        std::string base = fname.substr(slash == std::string::npos ? 0 : slash + 1);
+        size_t dot = base.find_last_of('.');
+        std::string ext = (dot == std::string::npos || dot == 0) ? "" : base.substr(dot + 1);
+        for (auto& ch : ext) ch = std::tolower((unsigned char)ch);
+        
+        if (first_line.compare(0, 2, "#!") == 0) {
+            std::istringstream words(first_line.substr(2));
+            std::string interp, arg;
+            words >> interp;
+            interp = interp.substr(interp.find_last_of('/') + 1);
+            if (interp == "env") {
+                while (words >> arg && arg[0] == '-') {}
+                interp = arg;
+            }
+            while (!interp.empty() && (std::isdigit((unsigned char)interp.back()) || interp.back() == '.')) interp.pop_back();
+            for (size_t i = 0; i < GRAMMAR_GENERIC && !interp.empty(); i++) {
+                if (has_word(grammar_specs[i].shebang, interp)) return load(i);
+            }
+        }
+        if (ext.empty() || ext == "txt" || ext == "log" || ext == "text" || ext == "out") return nullptr;
+        for (size_t i = 0; i < GRAMMAR_GENERIC; i++) {
+            if (has_word(grammar_specs[i].extensions, ext)) return load(i);
+        }
+        return load(GRAMMAR_GENERIC);
+    }
+    
+    static bool has_word(const char* list, const std::string& word) {
+        for (const char* p = list; *p; ) {
+            while (*p == ' ') p++;
+            size_t len = strcspn(p, " ");
+            if (len == word.size() && word.compare(0, len, p, len) == 0) return true;
+            p += len;
+        }
+        return false;
+    }
+};
+
+enum LexState { LEX_CODE, LEX_COMMENT, LEX_BACKTICK };
+
+static bool is_word_char(char c, const GrammarSpec* g) {
+    return std::isalnum((unsigned char)c) || c == '_' || c == ':' || (g && g->lisp_words && c && strchr("-!?*", c));
+}
+
+static size_t word_end(const std::string& line, size_t i, const GrammarSpec* g) {
+    while (i < line.length() && is_word_char(line[i], g)) i++;
+    if (g && g->bang_macros && i < line.length() && line[i] == '!') i++;
+    return i;
+}
+
+static bool is_bracket(char c) {
+    return c && strchr("()[]{}", c);
+}
+
+static size_t char_literal_end(const std::string& line, size_t i) {
+    size_t end;
+    if (i + 1 < line.size() && line[i + 1] == '\\') {
+        end = line.find('\'', i + 3);
+        if (end > i + 12) return std::string::npos;
+    } else {
+        unsigned char lead = i + 1 < line.size() ? line[i + 1] : 0;
+        end = i + 2 + (lead >= 0xf0) + (lead >= 0xe0) + (lead >= 0xc0);
+    }
+    return end < line.size() && line[end] == '\'' ? end : std::string::npos;
+}
+
+static int lex_brackets(const std::string& line, const GrammarSpec* g, int state,
+                        std::vector<std::pair<int, char>>* events, BracketSum* sum) {
+    size_t comment_len = g && g->line_comment ? strlen(g->line_comment) : 0;
+    int depth = 0, lowest = 0;
+    size_t i = 0, n = line.size();
+    while (i < n) {
+        char c = line[i];
+        if (state == LEX_COMMENT) {
+            size_t end = line.find("*/", i);
+            if (end == std::string::npos) break;
+            state = LEX_CODE;
+            i = end + 2;
+            continue;
+        }
+        if (state == LEX_BACKTICK) {
+            while (i < n && line[i] != '`') i += line[i] == '\\' ? 2 : 1;
+            if (i >= n) break;
+            state = LEX_CODE;
+            i++;
+            continue;
+        }
+        if (g) {
+            if (comment_len && line.compare(i, comment_len, g->line_comment) == 0) break;
+            if (g->block_comment && c == '/' && i + 1 < n && line[i + 1] == '*') {
+                state = LEX_COMMENT;
+                i += 2;
+                continue;
+            }
+            if (g->backtick && c == '`') {
+                state = LEX_BACKTICK;
+                i++;
+                continue;
+            }
+            if (c == '"') {
+                for (i++; i < n && line[i] != c; i += line[i] == '\\' ? 2 : 1) {}
+                i++;
+                continue;
+            }
+            if (c == '\'' && g->char_quotes) {
+                size_t end = char_literal_end(line, i);
+                if (end != std::string::npos) {
+                    i = end + 1;
+                    continue;
+                }
+            }
+        }
+        if (is_bracket(c)) {
+            depth += strchr("([{", c) ? 1 : -1;
+            lowest = std::min(lowest, depth);
+            if (events) events->push_back({(int)i, c});
+        }
+        i++;
+    }
+    if (sum) {
+        sum->sum = depth;
+        sum->minpre = lowest;
+    }
+    return state;
+}
+
+class BracketIndex {
+    CountedVector<BracketSum, MEM_DISPLAY> tree;
+    CountedVector<uint8_t, MEM_DISPLAY> out_state;
+    std::vector<int> pending;
+    size_t leaves;
+    size_t valid;
+    
+    static const BracketSum& line_sum(const Line& line, const GrammarSpec* g, int state) {
+        LineCache& c = line.cache();
+        if (c.lex_in != state) {
+            c.lex_out = lex_brackets(line, g, state, nullptr, &c.brackets);
+            c.lex_in = state;
+        }
+        return c.brackets;
+    }
+    
+    int state_before(size_t y) const { return y > 0 ? (int)out_state[y - 1] : (int)LEX_CODE; }
+    
+    const BracketSum& sum_at(const Lines& lines, const GrammarSpec* g, size_t y) const {
+        return line_sum(lines[y], g, state_before(y));
+    }
+    
+    void update_block(const Lines& lines, const GrammarSpec* g, size_t b) {
+        BracketSum s;
+        size_t end = std::min(lines.size(), (b + 1) * BRACKET_BLOCK);
+        for (size_t y = b * BRACKET_BLOCK; y < end; y++) s = BracketSum::join(s, sum_at(lines, g, y));
+        size_t node = leaves + b;
+        tree[node] = s;
+        for (node /= 2; node > 0; node /= 2) tree[node] = BracketSum::join(tree[2 * node], tree[2 * node + 1]);
+    }
+    
+    void rebuild(const Lines& lines, const GrammarSpec* g) {
+        size_t blocks = (lines.size() + BRACKET_BLOCK - 1) / BRACKET_BLOCK;
+        size_t from = std::min(valid, lines.size());
+        for (int y : pending) from = std::min<size_t>(from, y);
+        from = from / BRACKET_BLOCK * BRACKET_BLOCK;
+        if (blocks > leaves || tree.empty()) {
+            for (leaves = 1; leaves < blocks; leaves <<= 1) {}
+            from = 0;
+        }
+        tree.resize(2 * leaves);
+        std::fill(tree.begin() + leaves + from / BRACKET_BLOCK, tree.end(), BracketSum());
+        out_state.resize(lines.size());
+        int state = state_before(from);
+        for (size_t y = from; y < lines.size(); y++) {
+            const BracketSum& s = line_sum(lines[y], g, state);
+            state = out_state[y] = lines[y].cache().lex_out;
+            tree[leaves + y / BRACKET_BLOCK] = BracketSum::join(tree[leaves + y / BRACKET_BLOCK], s);
+        }
+        for (size_t node = leaves - 1; node > 0; node--) tree[node] = BracketSum::join(tree[2 * node], tree[2 * node + 1]);
+        pending.clear();
+        valid = lines.size();
+    }
+    
+    int first_block(size_t node, size_t l, size_t r, size_t from, int& acc, int target) const {
+        if (r <= from) return -1;
+        if (l >= from && acc + tree[node].minpre > target) {
+            acc += tree[node].sum;
+            return -1;
+        }
+        if (r - l == 1) return l;
+        size_t mid = (l + r) / 2;
+        int found = first_block(2 * node, l, mid, from, acc, target);
+        return found >= 0 ? found : first_block(2 * node + 1, mid, r, from, acc, target);
+    }
+    
+    int last_block(size_t node, size_t l, size_t r, size_t to, int& acc, int target) const {
+        if (l >= to) return -1;
+        if (r <= to && acc + tree[node].maxsuf() < target) {
+            acc += tree[node].sum;
+            return -1;
+        }
+        if (r - l == 1) return l;
+        size_t mid = (l + r) / 2;
+        int found = last_block(2 * node + 1, mid, r, to, acc, target);
+        return found >= 0 ? found : last_block(2 * node, l, mid, to, acc, target);
+    }
+    
+public:
+    BracketIndex() : leaves(1), valid(0) {}
+    
+    void touch(int y) { pending.push_back(y); }
+    void reshape(size_t from) { valid = std::min(valid, from); }
+    
+    void sync(const Lines& lines, const GrammarSpec* g) {
+        if (valid < out_state.size() || out_state.size() != lines.size()) {
+            rebuild(lines, g);
+            return;
+        }
+        std::sort(pending.begin(), pending.end());
+        std::vector<size_t> blocks;
+        size_t done = 0;
+        for (int y : pending) {
+            for (size_t i = std::max<size_t>(y, done); i < lines.size(); i++) {
+                uint8_t before = out_state[i];
+                line_sum(lines[i], g, state_before(i));
+                out_state[i] = lines[i].cache().lex_out;
+                if (blocks.empty() || blocks.back() != i / BRACKET_BLOCK) blocks.push_back(i / BRACKET_BLOCK);
+                done = i + 1;
+                if (out_state[i] == before) break;
+            }
+        }
+        for (size_t b : blocks) update_block(lines, g, b);
+        pending.clear();
+    }
+    
+    int unmatched_open(const Lines& lines, const GrammarSpec* g, int y) {
+        sync(lines, g);
+        std::vector<std::pair<int, char>> events;
+        lex_brackets(lines[y], g, state_before(y), &events, nullptr);
+        int depth = 0;
+        for (auto ev = events.rbegin(); ev != events.rend(); ++ev) {
+            depth += strchr("([{", ev->second) ? 1 : -1;
+            if (depth > 0) return ev->first;
+        }
+        return -1;
+    }
+    
+    bool match(const Lines& lines, const GrammarSpec* g, int y, int x, int& my, int& mx) {
+        sync(lines, g);
+        std::vector<std::pair<int, char>> events;
+        lex_brackets(lines[y], g, state_before(y), &events, nullptr);
+        int e = 0;
+        while (e < (int)events.size() && events[e].first != x) e++;
+        if (e == (int)events.size()) return false;
+        bool open = strchr("([{", events[e].second);
+        
+        int depth = 0;
+        for (int k = e; k >= 0 && k < (int)events.size(); k += open ? 1 : -1) {
+            depth += strchr("([{", events[k].second) ? 1 : -1;
+            if (depth == 0) {
+                my = y;
+                mx = events[k].first;
+                return true;
+            }
+        }
+        
+        int acc = 0, z = y;
+        if (open) {
+            int target = -depth;
+            size_t end = std::min(lines.size(), (y / BRACKET_BLOCK + 1) * (size_t)BRACKET_BLOCK);
+            for (z = y + 1; z < (int)end && acc + sum_at(lines, g, z).minpre > target; z++) acc += sum_at(lines, g, z).sum;
+            if (z == (int)end) {
+                if (end == lines.size()) return false;
+                int b = first_block(1, 0, leaves, y / BRACKET_BLOCK + 1, acc, target);
+                if (b < 0) return false;
+                for (z = b * BRACKET_BLOCK; acc + sum_at(lines, g, z).minpre > target; z++) acc += sum_at(lines, g, z).sum;
+            }
+            events.clear();
+            lex_brackets(lines[z], g, state_before(z), &events, nullptr);
+            for (const auto& ev : events) {
+                acc += strchr("([{", ev.second) ? 1 : -1;
+                if (acc == target) {
+                    my = z;
+                    mx = ev.first;
+                    return true;
+                }
+            }
+        } else {
+            int target = -depth;
+            int begin = y / BRACKET_BLOCK * BRACKET_BLOCK;
+            for (z = y - 1; z >= begin && acc + sum_at(lines, g, z).maxsuf() < target; z--) acc += sum_at(lines, g, z).sum;
+            if (z < begin) {
+                int b = last_block(1, 0, leaves, begin / BRACKET_BLOCK, acc, target);
+                if (b < 0) return false;
+                for (z = (b + 1) * BRACKET_BLOCK - 1; acc + sum_at(lines, g, z).maxsuf() < target; z--) acc += sum_at(lines, g, z).sum;
+            }
+            events.clear();
+            lex_brackets(lines[z], g, state_before(z), &events, nullptr);
+            for (auto ev = events.rbegin(); ev != events.rend(); ++ev) {
+                acc += strchr("([{", ev->second) ? 1 : -1;
+                if (acc == target) {
+                    my = z;
+                    mx = ev->first;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+class RowIndex {
+    CountedVector<int, MEM_DISPLAY> tree;
+    CountedVector<int, MEM_DISPLAY> rows;
+    std::vector<int> pending;
+    size_t valid;
+    int width;
+    
+    int wraps(const Line& line) const {
+        return line.empty() ? 1 : (int)((line.length() + width - 1) / width);
+    }
+    
+    void rebuild(const Lines& lines) {
+        size_t from = std::min({valid, rows.size(), lines.size()});
+        int hidden_until = -1;
+        if (from > 0) {
+            int seg;
+            size_t header = line_at(before(from) - 1, seg);
+            hidden_until = header + lines[header].folded();
+        }
+        bool append = (lines.size() - from) * 32 < lines.size();
+        rows.resize(from);
+        tree.resize(append ? from + 1 : 1);
+        for (size_t y = from; y < lines.size(); y++) {
+            int r = (int)y <= hidden_until ? 0 : wraps(lines[y]);
+            if (r > 0 && lines[y].folded()) hidden_until = y + lines[y].folded();
+            rows.push_back(r);
+            if (!append) continue;
+            size_t i = y + 1;
+            for (size_t j = i - 1, stop = i - (i & (0 - i)); j > stop; j -= j & (0 - j)) r += tree[j];
+            tree.push_back(r);
+        }
+        if (!append) {
+            tree.assign(rows.size() + 1, 0);
+            for (size_t i = 1; i < tree.size(); i++) {
+                tree[i] += rows[i - 1];
+                size_t j = i + (i & (0 - i));
+                if (j < tree.size()) tree[j] += tree[i];
+            }
+        }
+        valid = lines.size();
+    }
+    
+public:
+    RowIndex() : tree(1, 0), valid(0), width(0) {}
+    
+    void touch(int y) { pending.push_back(y); }
+    void reshape(size_t from) { valid = std::min(valid, from); }
+    
+    void sync(const Lines& lines, int w) {
+        if (w != width) {
+            width = w;
+            valid = 0;
+        }
+        size_t settled = std::min({valid, rows.size(), lines.size()});
+        for (int y : pending) {
+            if (y >= (int)settled || rows[y] == 0) continue;
+            int r = wraps(lines[y]);
+            for (size_t i = y + 1; i < tree.size(); i += i & (0 - i)) tree[i] += r - rows[y];
+            rows[y] = r;
+        }
+        pending.clear();
+        if (valid < rows.size() || rows.size() != lines.size()) rebuild(lines);
+    }
+    
+    int rows_of(size_t y) const { return rows[y]; }
+    int total() const { return before(rows.size()); }
+    
+    int before(size_t y) const {
+        int sum = 0;
+        for (size_t i = y; i > 0; i -= i & (0 - i)) sum += tree[i];
+        return sum;
+    }
+    
+    size_t line_at(int row, int& seg) const {
+        size_t pos = 0, step = 1;
+        while (step * 2 < tree.size()) step <<= 1;
+        for (; step; step >>= 1) {
+            if (pos + step < tree.size() && tree[pos + step] <= row) {
+                pos += step;
+                row -= tree[pos];
+            }
+        }
+        seg = row;
+        return pos;
+    }
+};
+
+class WordIndex {
+    std::map<std::string, int, std::less<std::string>, Counted<std::pair<const std::string, int>, MEM_CACHE>> counts;
+    CountedVector<Line, MEM_CACHE> indexed;
+    std::vector<int> pending;
+    size_t dirty_from;
+    bool built;
+    
+    void scan(const std::string& line, const GrammarSpec* g, int delta) {
+        for (size_t i = 0; i < line.size(); ) {
+            if (!(std::isalpha((unsigned char)line[i]) || line[i] == '_') || (i > 0 && is_word_char(line[i - 1], g))) {
+                i++;
+                continue;
+            }
+            size_t end = word_end(line, i, g), len = end - i;
+            while (len > 0 && line[i + len - 1] == ':') len--;
+            if (len >= 2 && len <= 64) {
+                auto it = counts.emplace(line.substr(i, len), 0).first;
+                if ((it->second += delta) <= 0) counts.erase(it);
+            }
+            i = end;
+        }
+    }
+    
+public:
+    WordIndex() : dirty_from(SIZE_MAX), built(false) {}
+    
+    void touch(int y) { if (built) pending.push_back(y); }
+    void reshape(size_t from) { if (built) dirty_from = std::min(dirty_from, from); }
+    
+    void reset() {
+        counts.clear();
+        indexed.clear();
+        pending.clear();
+        dirty_from = SIZE_MAX;
+        built = false;
+    }
+    
+    void sync(const Lines& lines, const GrammarSpec* g) {
+        if (!built) {
+            for (const auto& line : lines) scan(line, g, 1);
+            indexed.assign(lines.begin(), lines.end());
+            built = true;
+            return;
+        }
+        size_t from = std::min({dirty_from, indexed.size(), lines.size()});
+        for (int y : pending) {
+            if (y >= (int)from || indexed[y].same(lines[y])) continue;
+            scan(indexed[y], g, -1);
+            scan(lines[y], g, 1);
+            indexed[y] = lines[y];
+        }
+        if (dirty_from != SIZE_MAX) {
+            size_t old_end = indexed.size(), new_end = lines.size();
+            while (from < old_end && from < new_end && indexed[from].same(lines[from])) from++;
+            while (old_end > from && new_end > from && indexed[old_end - 1].same(lines[new_end - 1])) {
+                old_end--;
+                new_end--;
+            }
+            for (size_t y = from; y < old_end; y++) scan(indexed[y], g, -1);
+            for (size_t y = from; y < new_end; y++) scan(lines[y], g, 1);
+            indexed.erase(indexed.begin() + from, indexed.begin() + old_end);
+            indexed.insert(indexed.begin() + from, lines.begin() + from, lines.begin() + new_end);
+        }
+        pending.clear();
+        dirty_from = SIZE_MAX;
+    }
+    
+    std::vector<std::string> top(const std::string& prefix, size_t k) const {
+        std::vector<std::pair<int, const std::string*>> found;
+        for (auto it = counts.lower_bound(prefix); it != counts.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            if (it->first.size() > prefix.size()) found.push_back({-it->second, &it->first});
+        }
+        k = std::min(k, found.size());
+        std::partial_sort(found.begin(), found.begin() + k, found.end(), [](const std::pair<int, const std::string*>& a, const std::pair<int, const std::string*>& b) {
+            return a.first < b.first || (a.first == b.first && *a.second < *b.second);
+        });
+        std::vector<std::string> result;
+        for (size_t i = 0; i < k; i++) result.push_back(*found[i].second);
+        return result;
+    }
+};
+
+struct WakePipe {
+    int fds[2];
+    
+    WakePipe() : fds{-1, -1} {}
+    
+    ~WakePipe() {
+#ifndef _WIN32
+        if (fds[0] >= 0) close(fds[0]);
+        if (fds[1] >= 0) close(fds[1]);
+#endif
+    }
+    
+    bool open() {
+#ifdef _WIN32
+        return false;
+#else
+        if (pipe(fds) != 0) return false;
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        return true;
+#endif
+    }
+    
+    void notify() {
+#ifndef _WIN32
+        if (write(fds[1], "", 1) < 0) {}
+#endif
+    }
+    
+    void drain() {
+#ifndef _WIN32
+        char buf[256];
+        while (read(fds[0], buf, sizeof(buf)) > 0) {}
+#endif
+    }
+};
+
+struct StreamState {
+    std::mutex lock;
+    std::string data;
+    bool eof;
+    int fd, child;
+    WakePipe wake;
+    
+    StreamState(int source) : eof(false), fd(source), child(-1) {}
+    
+    ~StreamState() {
+#ifndef _WIN32
+        if (fd >= 0) close(fd);
+#endif
+    }
+};
+
+struct SearchHit {
+    std::string path, text;
+    int line, col;
+};
+
+struct SearchState {
+    std::mutex lock;
+    std::vector<SearchHit> hits;
+    std::atomic<bool> cancel;
+    bool done;
+    size_t searched, total;
+    WakePipe wake;
+    
+    SearchState() : cancel(false), done(false), searched(0), total(0) {}
+};
+
+#ifndef _WIN32
+static bool cloexec_pipe(int fds[2]) {
+    if (pipe(fds) != 0) return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+static pid_t run_gzip(const char* flags, int in, int out, const char* path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(in >= 0 ? in : null, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (path) execlp("gzip", "gzip", flags, "--", path, (char*)nullptr);
+        else execlp("gzip", "gzip", flags, (char*)nullptr);
+        _exit(127);
+    }
+    return pid;
+}
+
+static const char* find_bytes(const char* hay, size_t n, const std::string& needle) {
+    size_t m = needle.size();
+    if (m == 0 || n < m) return nullptr;
+    const char* end = hay + n - m + 1;
+    for (const char* p = hay; (p = (const char*)memchr(p, needle[0], end - p)); p++) {
+        if (memcmp(p, needle.data(), m) == 0) return p;
+    }
+    return nullptr;
+}
+
+static std::vector<std::string> load_ignores() {
+    std::vector<std::string> patterns;
+    std::ifstream file(".gitignore");
+    std::string line;
+    while (std::getline(file, line)) {
+        while (!line.empty() && isspace((unsigned char)line.back())) line.pop_back();
+        if (line.empty() || line[0] == '#' || line[0] == '!') continue;
+        patterns.push_back(line);
+    }
+    return patterns;
+}
+
+static bool ignored(const std::string& rel, const std::string& name, bool dir, const std::vector<std::string>& patterns) {
+    if (name[0] == '.' || (dir && name == "node_modules")) return true;
+    for (std::string pattern : patterns) {
+        if (pattern.back() == '/') {
+            if (!dir) continue;
+            pattern.pop_back();
+        }
+        bool anchored = pattern.find('/') != std::string::npos;
+        if (anchored && pattern[0] == '/') pattern.erase(0, 1);
+        if (fnmatch(pattern.c_str(), anchored ? rel.c_str() : name.c_str(), anchored ? FNM_PATHNAME : 0) == 0) return true;
+    }
+    return false;
+}
+
+static void walk_tree(const std::string& rel, const std::vector<std::string>& patterns, std::vector<std::string>& files, const std::atomic<bool>& cancel) {
+    DIR* dir = opendir(rel.empty() ? "." : rel.c_str());
+    if (!dir) return;
+    std::vector<std::string> subdirs;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        std::string path = rel.empty() ? name : rel + "/" + name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;
+        bool is_dir = S_ISDIR(st.st_mode);
+        if ((!is_dir && !S_ISREG(st.st_mode)) || ignored(path, name, is_dir, patterns)) continue;
+        if (is_dir) subdirs.push_back(path);
+        else files.push_back(path);
+    }
+    closedir(dir);
+    for (const auto& sub : subdirs) {
+        if (cancel) return;
+        walk_tree(sub, patterns, files, cancel);
+    }
+}
 
-struct EditorState {
-    std::vector<std::string> lines;
-    int cursor_x, cursor_y;
+static void search_file(const std::string& path, const std::string& needle, SearchState& state) {
+    std::vector<SearchHit> found;
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t size = st.st_size;
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            const char* data = (const char*)map;
+            const char* end = data + size;
+            if (!memchr(data, 0, std::min<size_t>(size, BINARY_SNIFF))) {
+                int line = 0;
+                const char* line_start = data;
+                const char* counted = data;
+                for (const char* p = data; (p = find_bytes(p, end - p, needle)); ) {
+                    for (const char* nl; (nl = (const char*)memchr(counted, '\n', p - counted)); counted = nl + 1) {
+                        line++;
+                        line_start = nl + 1;
+                    }
+                    counted = p;
+                    const char* eol = (const char*)memchr(p, '\n', end - p);
+                    if (!eol) eol = end;
+                    found.push_back({path, std::string(line_start, std::min<size_t>(eol - line_start, 256)), line, (int)(p - line_start)});
+                    if (found.size() >= SEARCH_MAX_HITS) break;
+                    p = eol;
+                }
+            }
+            munmap(map, size);
+        }
+    }
+    if (fd >= 0) close(fd);
     
-    EditorState() : cursor_x(0), cursor_y(0) {}
-    EditorState(const std::vector<std::string>& l, int x, int y) : lines(l), cursor_x(x), cursor_y(y) {}
-};
+    std::lock_guard<std::mutex> guard(state.lock);
+    state.hits.insert(state.hits.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+    state.searched++;
+    if (!found.empty() || state.searched % 256 == 0) state.wake.notify();
+}
+#endif
 
 class Editor {
 private:
-    std::vector<std::string> lines;
+    Lines lines;
     int cursor_x, cursor_y;
     std::string filename;
     bool running;
@@ -75,14 +1337,60 @@ private:
     time_t status_msg_time;
     int term_rows, term_cols;
     int top_line;
-    bool show_guide, show_credits;
+    bool show_guide, show_credits, show_memory, show_diff, show_results;
     bool modified;
     int visible_lines;
-    std::string clipboard;
+    Clip clipboard;
     bool insert_mode;
-    std::deque<EditorState> undo_stack;
+    int sel_x, sel_y;
+    bool sel_shift;
+    bool block_mode;
+    std::deque<EditorState, Counted<EditorState, MEM_UNDO>> undo_stack;
     std::string find_term;
     int find_line, find_col;
+    bool redraw;
+    int drawn_top;
+    int drawn_thumb_pos, drawn_thumb_size;
+    std::string drawn_header;
+    int repaint_line;
+    bool following;
+    int watch_fd, watch_wd;
+    uint64_t follow_offset, follow_ino;
+    uint64_t disk_size;
+    int64_t disk_mtime;
+    DiskChunks disk_chunks;
+    const Grammar* grammar;
+    BracketIndex brackets;
+    RowIndex row_index;
+    WordIndex words;
+    std::vector<std::string> suggestions;
+    int complete_start, complete_pick;
+    bool session_dirty;
+    std::vector<int> drawn_marks;
+    int64_t mem_cap;
+    std::string macro, typeahead;
+    bool recording, playing;
+    size_t play_pos;
+    std::vector<std::string> diff_view;
+    std::vector<int> diff_goto;
+    int diff_top;
+    std::shared_ptr<StreamState> stream_state;
+    std::thread stream_thread;
+    std::shared_ptr<SearchState> search_state;
+    std::thread search_thread;
+    std::vector<SearchHit> results;
+    std::string results_term;
+    int results_top, results_pick;
+    size_t results_files;
+    bool crlf, bom, compressed, partial;
+    bool hex_mode, hex_ascii, hex_low;
+    const uint8_t* hex_data;
+    size_t hex_size, hex_cursor, hex_top;
+    std::map<size_t, uint8_t, std::less<size_t>, Counted<std::pair<const size_t, uint8_t>, MEM_TEXT>> hex_edits;
+    CountedVector<std::pair<size_t, int>, MEM_UNDO> hex_undo;
+#ifdef _WIN32
+    std::vector<uint8_t> hex_buffer;
+#endif
     
 #ifdef _WIN32
     HANDLE hConsole;
@@ -94,8 +1402,15 @@ private:
 
 public:
     Editor() : cursor_x(0), cursor_y(0), running(true), status_msg_time(0),
-               top_line(0), show_guide(false), show_credits(false), 
-               modified(false), insert_mode(true), find_line(-1), find_col(-1) {
+               top_line(0), show_guide(false), show_credits(false), show_memory(false), show_diff(false), show_results(false),
+               modified(false), insert_mode(true), sel_x(0), sel_y(-1), sel_shift(false), block_mode(false), find_line(-1), find_col(-1),
+               redraw(true), drawn_top(-1), drawn_thumb_pos(-1), drawn_thumb_size(0),
+               repaint_line(-1), following(false), watch_fd(-1), watch_wd(-1),
+               follow_offset(0), follow_ino(0), disk_size(0), disk_mtime(0), grammar(nullptr),
+               complete_start(0), complete_pick(-1), session_dirty(false), mem_cap(0),
+               recording(false), playing(false), play_pos(0), diff_top(0),
+               results_top(0), results_pick(0), results_files(0),
+               crlf(false), bom(false), compressed(false), partial(false), hex_mode(false), hex_ascii(false), hex_low(false), hex_data(nullptr), hex_size(0), hex_cursor(0), hex_top(0) {
         lines.reserve(1000);
         lines.push_back("");
         filename = "unnamed.txt";
@@ -104,6 +1419,13 @@ public:
     }
     
     ~Editor() {
+        if (stream_thread.joinable()) stream_thread.detach();
+        if (search_thread.joinable()) {
+            search_state->cancel = true;
+            search_thread.detach();
+        }
+        unwatch();
+        close_hex();
         rst();
     }
     
@@ -124,13 +1446,16 @@ public:
 #else
         tcgetattr(STDIN_FILENO, &orig_term);
         struct termios raw_term = orig_term;
-        raw_term.c_lflag &= ~(ICANON | ECHO);
+        raw_term.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+        raw_term.c_iflag &= ~IXON;
         raw_term.c_cc[VMIN] = 1;
         raw_term.c_cc[VTIME] = 0;
         tcsetattr(STDIN_FILENO, TCSANOW, &raw_term);
         printf("\033[?1049h");
         printf("\033[6 q");
+        printf("\033[?1004h");
         signal(SIGINT, [](int){ exit(0); });
+        signal(SIGPIPE, SIG_IGN);
 #endif
     }
     
@@ -142,6 +1467,7 @@ public:
         SetConsoleMode(hInput, orig_mode);
 #else
         tcsetattr(STDIN_FILENO, TCSANOW, &orig_term);
+        printf("\033[?1004l");
         printf("\033[0 q");
         printf("\033[?1049l\033[H\033[J");
         fflush(stdout);
@@ -182,22 +1508,88 @@ public:
     }
     
     void save_state() {
+        if (playing) return;
         if (undo_stack.size() >= MAX_UNDO_STACK) {
             undo_stack.pop_front();
         }
+        if (!undo_stack.empty()) undo_stack.back().keep_head = SIZE_MAX;
         undo_stack.emplace_back(lines, cursor_x, cursor_y);
+        redraw = true;
+    }
+    
+    void edited(int y) {
+        lines[y].settle();
+        mark_changed(y);
+        brackets.touch(y);
+        row_index.touch(y);
+        words.touch(y);
+    }
+    
+    void reshaped(size_t from) {
+        if (from < lines.size()) lines[from].settle();
+        brackets.reshape(from);
+        row_index.reshape(from);
+        words.reshape(from);
+    }
+    
+    void mark(size_t y, int bits) {
+        y = std::min(y, lines.size() - 1);
+        lines[y].set_marks(lines[y].marks() | bits);
+    }
+    
+    void mark_changed(int y) {
+        if (!(lines[y].marks() & MARK_ADDED)) mark(y, MARK_CHANGED);
+    }
+    
+    void mark_added(size_t y, size_t n) {
+        for (size_t i = y; i < y + n; i++) lines[i].set_marks(MARK_ADDED);
+    }
+    
+    void erase_lines(size_t from, size_t to) {
+        int bits = 0;
+        for (size_t y = from; y < to; y++) {
+            bits |= lines[y].marks() & MARK_ADDED ? lines[y].marks() & MARK_REMOVED : MARK_REMOVED;
+        }
+        lines.erase(lines.begin() + from, lines.begin() + to);
+        if (lines.empty()) lines.push_back("");
+        if (bits) mark(from, bits);
+    }
+    
+    void next_change() {
+        int n = lines.size(), y = cursor_y;
+        auto starts = [&](int i) {
+            int m = lines[i].marks();
+            return m && (i == 0 || m & MARK_REMOVED || !(lines[i - 1].marks() & (MARK_CHANGED | MARK_ADDED)));
+        };
+        for (int i = 0; i < n; i++) {
+            y = (y + 1) % n;
+            if (starts(y)) break;
+        }
+        if (!starts(y)) {
+            msg("No changes since last save");
+            return;
+        }
+        if (sel_y >= 0) redraw = true;
+        reveal(y);
+        cursor_y = y;
+        cursor_x = 0;
+        msg("Change at line " + std::to_string(y + 1));
     }
     
     void undo() {
         if (!undo_stack.empty()) {
             EditorState state = undo_stack.back();
             undo_stack.pop_back();
-            lines = std::move(state.lines);
+            lines.assign(std::make_move_iterator(state.lines.begin()), std::make_move_iterator(state.lines.end()));
+            reshaped(0);
+            sel_y = -1;
+            block_mode = false;
             cursor_x = state.cursor_x;
             cursor_y = state.cursor_y;
             if (cursor_y >= (int)lines.size()) cursor_y = lines.size() - 1;
             if (cursor_x > (int)lines[cursor_y].length()) cursor_x = lines[cursor_y].length();
             modified = true;
+            redraw = true;
             msg("Undo successful");
         }
     }
@@ -219,6 +1611,44 @@ public:
         std::cout.flush();
     }
     
+    static std::string mem_size(int64_t bytes) {
+        char buf[32];
+        if (bytes >= 1024 * 1024) snprintf(buf, sizeof(buf), "%.1f MB", bytes / 1048576.0);
+        else snprintf(buf, sizeof(buf), "%.1f KB", bytes / 1024.0);
+        return buf;
+    }
+    
+    void mem() {
+        clr();
+        std::cout << "\033[1;37m  SAC++ Editor - Memory \033[0m\n\n";
+        std::cout << "  \033[1;32mCategory        Current       Peak\033[0m\n";
+        for (int i = 0; i < MEM_CATEGORIES; i++) {
+            std::cout << "    " << std::left << std::setw(14) << mem_names[i] << std::right
+                      << std::setw(10) << mem_size(mem_used[i]) << std::setw(11) << mem_size(mem_peak[i]) << "\n";
+        }
+        std::cout << "    " << std::left << std::setw(14) << "Total" << std::right << std::setw(10) << mem_size(mem_total()) << "\n\n";
+        std::cout << "  \033[1;32mCap:\033[0m " << (mem_cap > 0 ? mem_size(mem_cap) : std::string("none")) << "\n";
+        std::cout << "  \033[1;32mUndo steps:\033[0m " << undo_stack.size() << "\n\n";
+        std::cout << "  \033[1;33mEnter to return\033[0m";
+        std::cout.flush();
+    }
+    
+    bool near_cap() const {
+        return mem_cap > 0 && mem_total() * 100 >= mem_cap * MEMORY_TRIM;
+    }
+    
+    void trim_memory() {
+        if (!near_cap()) return;
+        words.reset();
+        size_t dropped = 0;
+        while (undo_stack.size() > 1 && near_cap()) {
+            undo_stack.pop_front();
+            dropped++;
+        }
+        if (mem_total() >= mem_cap) msg("Warning: memory cap reached (" + mem_size(mem_total()) + ")");
+        else if (dropped) msg("Memory low: dropped " + std::to_string(dropped) + " oldest undo steps");
+    }
+    
     void gd() {
         clr();
         std::cout << "\033[1;37m  SAC++ Editor - Guide \033[0m\n\n";
@@ -227,8 +1657,10 @@ public:
         std::cout << "    ^Q  Quit editor      ^W  New file\n\n";
         std::cout << "  \033[1;32mEdit Operations:\033[0m\n";
         std::cout << "    ^U  Undo             ^Y  Redo\n";
-        std::cout << "    ^X  Cut line         ^C  Copy line\n";
-        std::cout << "    ^A  Select all\n";
+        std::cout << "    ^X  Cut line/region  ^C  Copy line/region\n";
+        std::cout << "    ^A  Select all       ^V  Paste\n";
+        std::cout << "    ^B  Set/unset mark   Shift+Arrows  Select\n";
+        std::cout << "    ^K  Block (column) mode, edits apply to every line\n";
         std::cout << "    ^F  Find text        ^R  Replace\n\n";
         std::cout << "  \033[1;32mNavigation:\033[0m\n";
         std::cout << "    Arrow keys  Move cursor\n";
@@ -237,65 +1669,49 @@ public:
         std::cout << "    ^Home/End   File start/end\n\n";
         std::cout << "  \033[1;32mMode:\033[0m\n";
         std::cout << "    Insert  Insert mode (default)\n";
-        std::cout << "    ^I      Toggle insert/overwrite\n\n";
+        std::cout << "    ^I      Toggle insert/overwrite\n";
+        std::cout << "    -x      Hex view (binary files open in it): Tab hex/ASCII, ^L offset\n\n";
         std::cout << "  \033[1;32mOther:\033[0m\n";
         std::cout << "    ^G  Help             ^N  Credits\n";
-        std::cout << "    ^L  Line goto        ^D  Delete line\n\n";
+        std::cout << "    ^L  Line goto        ^D  Delete line\n";
+        std::cout << "    ^]  Match bracket    ^P  Fold/unfold\n";
+        std::cout << "    ^T  Follow file (tail -f)  ^E  Memory usage\n";
+        std::cout << "    F5  Diff against disk    F6  Next change\n";
+        std::cout << "    F7  Sort/unique/filter   F8  Search files\n";
+        std::cout << "    ^Space  Complete word (repeat to cycle)\n";
+        std::cout << "    ^\\  Record macro      ^_  Play macro (with count)\n\n";
         std::cout << "  \033[1;33mEnter to return\033[0m";
         std::cout.flush();
     }
     
-    std::vector<std::string> wrap_line(const std::string& line, int max_width) {
-        std::vector<std::string> wrapped;
-        if (line.empty()) {
-            wrapped.push_back("");
-            return wrapped;
-        }
-        
-        int pos = 0;
-        while (pos < (int)line.length()) {
-            int end_pos = std::min(pos + max_width, (int)line.length());
-            wrapped.push_back(line.substr(pos, end_pos - pos));
-            pos = end_pos;
-        }
+    void scrbar(int total_rows, int first = 0, int last = -1) {
+        if (last < 0) last = visible_lines;
         
-        return wrapped;
-    }
-    
-    void scrbar() {
-        std::vector<std::string> display_lines;
-        for (const auto& line : lines) {
-            auto wrapped = wrap_line(line, term_cols - 7);
-            display_lines.insert(display_lines.end(), wrapped.begin(), wrapped.end());
+        int thumb_pos = -1, thumb_size = 0;
+        if (total_rows > visible_lines) {
+            thumb_size = (visible_lines * visible_lines) / total_rows;
+            if (thumb_size < 1) thumb_size = 1;
+            thumb_pos = (visible_lines * top_line) / total_rows;
         }
         
-        if (display_lines.size() <= (size_t)visible_lines) {
-            for (int i = 0; i < visible_lines; i++) {
-#ifdef _WIN32
-                SetConsoleCursorPosition(hConsole, {(SHORT)(term_cols-1), (SHORT)(i+1)});
-                std::cout << "\033[44m \033[0m";
-#else
-                printf("\033[%d;%dH\033[44m \033[0m", i + 2, term_cols);
-#endif
-            }
-        } else {
-            int thumb_size = (visible_lines * visible_lines) / (int)display_lines.size();
-            if (thumb_size < 1) thumb_size = 1;
-            int thumb_pos = (visible_lines * top_line) / (int)display_lines.size();
-            
-            for (int i = 0; i < visible_lines; i++) {
+        for (int i = 0; i < visible_lines; i++) {
+            bool on_thumb = i >= thumb_pos && i < thumb_pos + thumb_size;
+            bool was_thumb = i >= drawn_thumb_pos && i < drawn_thumb_pos + drawn_thumb_size;
+            if ((i < first || i >= last) && on_thumb == was_thumb) continue;
 #ifdef _WIN32
-                SetConsoleCursorPosition(hConsole, {(SHORT)(term_cols-1), (SHORT)(i+1)});
+            SetConsoleCursorPosition(hConsole, {(SHORT)(term_cols-1), (SHORT)(i+1)});
 #else
-                printf("\033[%d;%dH", i + 2, term_cols);
+            printf("\033[%d;%dH", i + 2, term_cols);
 #endif
-                if (i >= thumb_pos && i < thumb_pos + thumb_size) {
-                    std::cout << "\033[46m \033[0m";
-                } else {
-                    std::cout << "\033[44m \033[0m";
-                }
+            if (on_thumb) {
+                std::cout << "\033[46m \033[0m";
+            } else {
+                std::cout << "\033[44m \033[0m";
             }
         }
+        
+        drawn_thumb_pos = thumb_pos;
+        drawn_thumb_size = thumb_size;
     }
     
     void highlight_line(const std::string& line, int max_width) {
@@ -310,89 +1726,12 @@ public:
 	    bool in_doc_comment = false;
 	    char string_char = 0;
 	    
-	    std::vector<std::string> keywords = {
-	        "if", "else", "elif", "for", "while", "do", "switch", "case", "default", "break", "continue",
-	        "return", "void", "int", "char", "float", "double", "long", "short", "bool", "true", "false",
-	        "const", "static", "extern", "auto", "register", "volatile", "signed", "unsigned", "mutable",
-	        "struct", "union", "enum", "typedef", "class", "public", "private", "protected", "operator",
-	        "virtual", "inline", "friend", "template", "namespace", "using", "this", "new", "delete",
-	        "try", "catch", "throw", "nullptr", "override", "final", "constexpr", "decltype", "noexcept",
-	        "function", "var", "let", "const", "async", "await", "import", "export", "from", "default",
-	        "def", "class", "self", "import", "from", "as", "lambda", "yield", "with", "global", "nonlocal",
-	        "pass", "raise", "assert", "del", "is", "in", "not", "and", "or", "None", "True", "False",
-	        "package", "main", "func", "go", "defer", "chan", "select", "interface", "type", "var",
-	        "map", "range", "make", "len", "cap", "append", "copy", "close", "goroutine", "fallthrough",
-	        "public", "static", "void", "main", "String", "System", "out", "println", "print", "class",
-	        "extends", "implements", "super", "abstract", "final", "synchronized", "throws", "native",
-	        "fn", "let", "mut", "match", "impl", "trait", "mod", "use", "crate", "pub", "where",
-	        "Some", "None", "Ok", "Err", "Vec", "HashMap", "BTreeMap", "Option", "Result", "Box",
-	        "require", "module", "exports", "process", "console", "window", "document", "typeof",
-	        "instanceof", "prototype", "constructor", "super", "extends", "implements", "interface",
-	        "macro", "quote", "unquote", "splice", "gensym", "defmacro", "eval", "apply", "quote",
-	        "begin", "cond", "define", "lambda", "quote", "set!", "if", "unless", "when", "case",
-	        "SELECT", "FROM", "WHERE", "JOIN", "INNER", "LEFT", "RIGHT", "FULL", "OUTER", "ON",
-	        "INSERT", "UPDATE", "DELETE", "CREATE", "ALTER", "DROP", "TABLE", "DATABASE", "INDEX",
-	        "PRIMARY", "KEY", "FOREIGN", "REFERENCES", "UNIQUE", "NOT", "NULL", "DEFAULT", "CHECK",
-	        "GRANT", "REVOKE", "COMMIT", "ROLLBACK", "TRANSACTION", "BEGIN", "END", "DECLARE",
-	        "PROCEDURE", "FUNCTION", "TRIGGER", "VIEW", "CURSOR", "LOOP", "WHILE", "FOR", "IF"
-	    };
-	    
-	    std::vector<std::string> types = {
-	        "std::string", "std::vector", "std::map", "std::set", "std::pair", "std::unique_ptr",
-	        "std::shared_ptr", "std::weak_ptr", "std::array", "std::deque", "std::list", "std::queue",
-	        "std::stack", "std::priority_queue", "std::unordered_map", "std::unordered_set",
-	        "size_t", "uint8_t", "uint16_t", "uint32_t", "uint64_t", "int8_t", "int16_t", "int32_t",
-	        "int64_t", "wchar_t", "char16_t", "char32_t", "ptrdiff_t", "intptr_t", "uintptr_t",
-	        "string", "String", "Array", "Object", "Number", "Boolean", "Symbol", "BigInt", "undefined",
-	        "null", "Promise", "RegExp", "Date", "Error", "Map", "Set", "WeakMap", "WeakSet",
-	        "list", "dict", "tuple", "set", "frozenset", "bytearray", "bytes", "memoryview", "slice",
-	        "[]int", "[]string", "[]byte", "map[string]int", "chan int", "interface{}", "struct{}",
-	        "Integer", "Double", "Float", "Long", "Short", "Byte", "Character", "Boolean", "Object",
-	        "ArrayList", "HashMap", "HashSet", "LinkedList", "Stack", "Queue", "Vector", "TreeMap",
-	        "i8", "i16", "i32", "i64", "i128", "u8", "u16", "u32", "u64", "u128", "f32", "f64",
-	        "usize", "isize", "str", "&str", "String", "Vec", "Box", "Rc", "Arc", "Cell", "RefCell",
-	        "INT", "VARCHAR", "CHAR", "TEXT", "BLOB", "REAL", "NUMERIC", "DECIMAL", "BOOLEAN",
-	        "DATE", "TIME", "TIMESTAMP", "DATETIME", "YEAR", "BINARY", "VARBINARY", "ENUM",
-	        "JSON", "XML", "UUID", "SERIAL", "BIGSERIAL", "SMALLSERIAL", "MONEY", "INET", "CIDR"
-	    };
-	    
-	    std::vector<std::string> constants = {
-	        "NULL", "TRUE", "FALSE", "nullptr", "true", "false", "None", "True", "False", "nil",
-	        "undefined", "null", "NaN", "Infinity", "Math", "PI", "E", "SQRT2", "LN2", "LOG2E",
-	        "MAX_VALUE", "MIN_VALUE", "POSITIVE_INFINITY", "NEGATIVE_INFINITY", "MAX_SAFE_INTEGER",
-	        "MIN_SAFE_INTEGER", "EPSILON", "stdout", "stderr", "stdin", "EOF", "EXIT_SUCCESS",
-	        "EXIT_FAILURE", "RAND_MAX", "CLOCKS_PER_SEC", "CHAR_BIT", "CHAR_MAX", "CHAR_MIN",
-	        "INT_MAX", "INT_MIN", "LONG_MAX", "LONG_MIN", "SHRT_MAX", "SHRT_MIN", "UCHAR_MAX",
-	        "UINT_MAX", "ULONG_MAX", "USHRT_MAX", "FLT_MAX", "FLT_MIN", "DBL_MAX", "DBL_MIN"
-	    };
-	    
-	    std::vector<std::string> builtins = {
-	        "printf", "scanf", "malloc", "free", "sizeof", "strlen", "strcpy", "strcat", "strcmp",
-	        "memcpy", "memset", "memmove", "abs", "fabs", "sqrt", "pow", "sin", "cos", "tan",
-	        "log", "exp", "ceil", "floor", "round", "min", "max", "swap", "sort", "reverse",
-	        "print", "input", "len", "range", "enumerate", "zip", "map", "filter", "reduce",
-	        "sorted", "reversed", "sum", "any", "all", "min", "max", "abs", "round", "pow",
-	        "divmod", "bin", "oct", "hex", "ord", "chr", "str", "int", "float", "bool", "list",
-	        "dict", "tuple", "set", "frozenset", "type", "isinstance", "issubclass", "hasattr",
-	        "getattr", "setattr", "delattr", "dir", "vars", "globals", "locals", "eval", "exec",
-	        "compile", "open", "close", "read", "write", "readline", "readlines", "writelines",
-	        "fmt", "Println", "Printf", "Sprintf", "len", "make", "append", "copy", "delete",
-	        "panic", "recover", "defer", "go", "select", "close", "cap", "new", "reflect",
-	        "System", "out", "err", "in", "println", "print", "printf", "Scanner", "BufferedReader",
-	        "FileReader", "FileWriter", "ArrayList", "HashMap", "HashSet", "Collections", "Arrays",
-	        "String", "Integer", "Double", "Float", "Boolean", "Character", "Math", "Random",
-	        "println!", "print!", "format!", "panic!", "assert!", "debug_assert!", "vec!",
-	        "macro_rules!", "include!", "include_str!", "include_bytes!", "env!", "option_env!",
-	        "concat!", "stringify!", "line!", "column!", "file!", "module_path!", "cfg!"
-	    };
-	    
-	    std::vector<std::string> preprocessor = {
-	        "#include", "#define", "#undef", "#ifdef", "#ifndef", "#if", "#else", "#elif",
-	        "#endif", "#pragma", "#error", "#warning", "#line", "#import", "#using",
-	        "@interface", "@implementation", "@protocol", "@property", "@synthesize",
-	        "@dynamic", "@selector", "@encode", "@defs", "@synchronized", "@autoreleasepool",
-	        "@try", "@catch", "@finally", "@throw", "@class", "@public", "@private", "@protected"
-	    };
+	    if (!grammar) {
+	        std::cout << line.substr(0, max_width);
+	        return;
+	    }
+	    const GrammarSpec& g = *grammar->spec;
+	    size_t comment_len = g.line_comment ? strlen(g.line_comment) : 0;
 	    
 	    for (size_t i = 0; i < line.length() && i < (size_t)max_width; i++) {
 	        char c = line[i];
@@ -400,12 +1739,12 @@ public:
 	        char next_next_c = (i + 2 < line.length()) ? line[i + 2] : '\0';
 	        
 	        if (!in_string && !in_char && !in_comment && !in_single_comment && !in_multi_comment && !in_regex && !in_template_string && !in_raw_string) {
-	            if (c == '/' && next_c == '/') {
+	            if (comment_len && line.compare(i, comment_len, g.line_comment) == 0) {
 	                in_single_comment = true;
 	                std::cout << "\033[38;5;240m" << c;
 	                continue;
 	            }
-	            if (c == '/' && next_c == '*') {
+	            if (g.block_comment && c == '/' && next_c == '*') {
 	                if (next_next_c == '*') {
 	                    in_doc_comment = true;
 	                    std::cout << "\033[38;5;240m" << c;
@@ -415,28 +1754,13 @@ public:
 	                }
 	                continue;
 	            }
-	            if (c == '#') {
+	            if (c == '#' && g.directives) {
 	                std::string word;
-	                size_t start = i;
 	                while (i < line.length() && !std::isspace(line[i])) {
 	                    word += line[i++];
 	                }
 	                i--;
-	                
-	                bool is_preprocessor = false;
-	                for (const auto& prep : preprocessor) {
-	                    if (word == prep) {
-	                        is_preprocessor = true;
-	                        break;
-	                    }
-	                }
-	                
-	                if (is_preprocessor || c == '#') {
-	                    std::cout << "\033[38;5;123m" << word << "\033[0m";
-	                } else {
-	                    in_single_comment = true;
-	                    std::cout << "\033[38;5;240m" << word;
-	                }
+	                std::cout << "\033[38;5;123m" << word << "\033[0m";
 	                continue;
 	            }
 	            if (c == '@' && std::isalpha(next_c)) {
@@ -469,7 +1793,7 @@ public:
 	            continue;
 	        }
 	        
-	        if (!in_string && !in_char && !in_template_string && !in_raw_string && (c == '"' || c == '\'' || c == '`')) {
+	        if (!in_string && !in_char && !in_template_string && !in_raw_string && (c == '"' || (c == '\'' && g.char_quotes) || (c == '`' && g.backtick))) {
 	            if (c == '`') {
 	                in_template_string = true;
 	                std::cout << "\033[38;5;43m" << c;
@@ -517,7 +1841,7 @@ public:
 	            } else {
 	                std::cout << c;
 	            }
-	        } else if (c == '/' && next_c != '/' && next_c != '*' && !in_string && !in_char) {
+	        } else if (g.regex && c == '/' && next_c != '/' && next_c != '*' && !in_string && !in_char) {
 	            if (i > 0 && (line[i-1] == '=' || line[i-1] == '(' || line[i-1] == ',' || line[i-1] == ':' || line[i-1] == '[' || line[i-1] == '!' || line[i-1] == '&' || line[i-1] == '|' || line[i-1] == '?' || line[i-1] == '{' || line[i-1] == '}' || line[i-1] == ';' || line[i-1] == '\n')) {
 	                in_regex = true;
 	                std::cout << "\033[38;5;123m" << c;
@@ -537,7 +1861,7 @@ public:
 	            } else {
 	                std::cout << c;
 	            }
-	        } else if (c == '<' && !in_string && !in_char) {
+	        } else if (g.angle && c == '<' && !in_string && !in_char) {
 	            in_angle = true;
 	            std::cout << "\033[38;5;87m" << c;
 	        } else if (c == '>' && in_angle) {
@@ -581,51 +1905,15 @@ public:
 	            }
 	            std::cout << "\033[0m";
 	        } else if (std::isalpha(c) || c == '_') {
-	            std::string word;
-	            size_t start = i;
-	            while (i < line.length() && (std::isalnum(line[i]) || line[i] == '_' || line[i] == ':')) {
-	                word += line[i++];
-	            }
-	            i--;
-	            
-	            bool is_keyword = false;
-	            bool is_type = false;
-	            bool is_constant = false;
-	            bool is_builtin = false;
-	            
-	            for (const auto& keyword : keywords) {
-	                if (word == keyword) {
-	                    is_keyword = true;
-	                    break;
-	                }
-	            }
-	            
-	            if (!is_keyword) {
-	                for (const auto& type : types) {
-	                    if (word == type) {
-	                        is_type = true;
-	                        break;
-	                    }
-	                }
-	            }
-	            
-	            if (!is_keyword && !is_type) {
-	                for (const auto& constant : constants) {
-	                    if (word == constant) {
-	                        is_constant = true;
-	                        break;
-	                    }
-	                }
-	            }
+	            size_t end = word_end(line, i, &g);
+	            std::string word = line.substr(i, end - i);
+	            i = end - 1;
 	            
-	            if (!is_keyword && !is_type && !is_constant) {
-	                for (const auto& builtin : builtins) {
-	                    if (word == builtin) {
-	                        is_builtin = true;
-	                        break;
-	                    }
-	                }
-	            }
+	            int word_class = grammar->lookup(word.data(), word.size());
+	            bool is_keyword = word_class == WORD_KEYWORD;
+	            bool is_type = word_class == WORD_TYPE;
+	            bool is_constant = word_class == WORD_CONSTANT;
+	            bool is_builtin = word_class == WORD_BUILTIN;
 	            
 	            if (is_keyword) {
 	                std::cout << "\033[38;5;81m" << word << "\033[0m";
@@ -655,132 +1943,1149 @@ public:
 	    if (in_regex) std::cout << "\033[0m";
 	}
 	
+    void drw_row(int i) {
+        int width = term_cols - 7, seg = 0;
+        size_t y = i < row_index.total() ? row_index.line_at(i, seg) : lines.size();
+        if (y < lines.size()) {
+            int original_line = y;
+            const std::string& text = lines[y].str();
+            int offset = seg * width;
+            std::string row = text.substr(std::min<size_t>(offset, text.size()), width);
+            bool last_segment = seg + 1 == row_index.rows_of(y);
+            int folded = lines[y].folded();
+            int marks = lines[y].marks();
+            const char* gutter = marks & MARK_ADDED ? "\033[0;32m" : marks & MARK_CHANGED ? "\033[0;33m" :
+                                 marks & MARK_REMOVED && seg == 0 ? "\033[0;31m" : "\033[0;37m";
+            std::cout << "\033[0;37m" << std::setw(4) << (original_line + 1) << gutter
+                      << (folded && seg == 0 ? " +" : marks & MARK_REMOVED && seg == 0 ? " ^" : " |") << "\033[0m ";
+            
+            int y1, x1, y2, x2;
+            bool block = block_mode && block_rect(y1, x1, y2, x2);
+            if ((block || selection(y1, x1, y2, x2)) && original_line >= y1 && original_line <= y2) {
+                int from = (block || original_line == y1) ? std::max(0, x1 - offset) : 0;
+                int to = (block || original_line == y2) ? x2 - offset : (int)row.length();
+                if (block && x1 == x2) to = from + 1;
+                from = std::min(from, (int)row.length());
+                to = std::max(from, std::min(to, (int)row.length()));
+                std::cout << row.substr(0, from) << "\033[7m" << row.substr(from, to - from) << "\033[0m" << row.substr(to);
+                if (!block && original_line < y2 && last_segment) std::cout << "\033[7m \033[0m";
+            } else {
+                highlight_line(row, width);
+            }
+            if (folded && last_segment && width - (int)row.length() > 20) {
+                std::cout << "\033[38;5;240m ... " << folded << " lines\033[0m";
+            }
+        } else {
+            std::cout << "\033[1;37m" << std::setw(4) << (i + 1) << " |\033[0m";
+        }
+    }
+    
+    void scroll_rows(int shift, int total_rows) {
+        int first = 0, last = 0;
+        if (shift > 0) {
+            printf("\033[2;%dr\033[%dS\033[r", visible_lines + 1, shift);
+            first = visible_lines - shift;
+            last = visible_lines;
+        } else if (shift < 0) {
+            printf("\033[2;%dr\033[%dT\033[r", visible_lines + 1, -shift);
+            first = 0;
+            last = -shift;
+        }
+        drawn_thumb_pos -= shift;
+        
+        int repaint_row = visible_lines;
+        if (repaint_line >= 0) {
+            int row = row_index.before(std::min<size_t>(repaint_line, lines.size())) - top_line;
+            repaint_row = std::max(0, std::min(row, visible_lines));
+        }
+        
+        for (int row = 0; row < visible_lines; row++) {
+            if ((row < first || row >= last) && row < repaint_row) continue;
+            printf("\033[%d;1H\033[K", row + 2);
+            drw_row(top_line + row);
+        }
+        
+        if (repaint_row < visible_lines) {
+            first = std::min(first == last ? repaint_row : first, repaint_row);
+            last = visible_lines;
+        }
+        scrbar(total_rows, first, last);
+    }
+    
     void drw() {
+        if (playing) return;
+        
         if (show_guide) {
             gd();
+            redraw = true;
+            return;
+        }
+        
+        if (show_credits) {
+            crd();
+            redraw = true;
+            return;
+        }
+        
+        if (show_memory) {
+            mem();
+            redraw = true;
+            return;
+        }
+        
+        if (show_diff) {
+            dif();
+            redraw = true;
+            return;
+        }
+        
+        if (show_results) {
+            res();
+            redraw = true;
+            return;
+        }
+        
+        if (hex_mode) {
+            hex_drw();
+            return;
+        }
+        
+        int prev_rows = term_rows, prev_cols = term_cols;
+        sz();
+        if (term_rows != prev_rows || term_cols != prev_cols) redraw = true;
+        
+        char mod_indicator = modified ? '*' : ' ';
+        std::string mode_str = insert_mode ? "INS" : "OVR";
+        if (following) mode_str += " | FOLLOW";
+        if (recording) mode_str += " | REC";
+        if (crlf) mode_str += " | CRLF";
+        if (bom) mode_str += " | BOM";
+        if (block_mode) mode_str += " | BLOCK";
+        std::string header = "\033[1;36m~ SAC++: " + filename + " " + mod_indicator + " ~\033[0m";
+        
+        adj();
+        int chars_before_cursor;
+        int cursor_display_line = cursor_row(chars_before_cursor);
+        int total_rows = row_index.total();
+        
+        bool scrolled = false;
+#ifndef _WIN32
+        int shift = top_line - drawn_top;
+        if (!redraw && drawn_top >= 0 && std::abs(shift) < visible_lines) {
+            if (header != drawn_header) {
+                printf("\033[1;1H\033[K");
+                std::cout << header;
+            }
+            scroll_rows(shift, total_rows);
+            scrolled = true;
+        }
+#endif
+        
+        if (!scrolled) {
+            clr();
+#ifdef _WIN32
+            SetConsoleCursorPosition(hConsole, {0, 0});
+#endif
+            std::cout << header << "\n";
+            
+            for (int i = top_line; i < top_line + visible_lines; i++) {
+                drw_row(i);
+                std::cout << "\n";
+            }
+            
+            drawn_thumb_pos = -1;
+            drawn_thumb_size = 0;
+            scrbar(total_rows);
+        }
+        
+        std::vector<int> marks;
+        int by, bx, my, mx;
+        if (bracket_match(by, bx, my, mx)) {
+            int width = term_cols - 7;
+            for (int k = 0; k < 2; k++) {
+                int y = k ? my : by, x = k ? mx : bx;
+                if (row_index.rows_of(y) == 0) continue;
+                marks.push_back(row_index.before(y) + std::min(x / width, row_index.rows_of(y) - 1));
+                marks.push_back(x % width);
+                marks.push_back(lines[y][x]);
+            }
+        }
+        
+#ifndef _WIN32
+        for (size_t k = 0; scrolled && k < drawn_marks.size(); k += 3) {
+            int row = drawn_marks[k];
+            bool kept = false;
+            for (size_t j = 0; j < marks.size(); j += 3) kept |= marks[j] == row && marks[j + 1] == drawn_marks[k + 1];
+            if (kept || row < top_line || row >= top_line + visible_lines) continue;
+            printf("\033[%d;1H\033[K", row - top_line + 2);
+            drw_row(row);
+            scrbar(total_rows, row - top_line, row - top_line + 1);
+        }
+#endif
+        for (size_t k = 0; k < marks.size(); k += 3) {
+            int row = marks[k] - top_line;
+            if (row < 0 || row >= visible_lines) continue;
+#ifdef _WIN32
+            SetConsoleCursorPosition(hConsole, {(SHORT)(marks[k + 1] + 7), (SHORT)(row + 1)});
+#else
+            printf("\033[%d;%dH", row + 2, marks[k + 1] + 8);
+#endif
+            std::cout << "\033[1;33;44m" << (char)marks[k + 2] << "\033[0m";
+        }
+        drawn_marks = marks;
+        
+        drawn_top = top_line;
+        drawn_header = header;
+        redraw = false;
+        repaint_line = -1;
+        
+#ifdef _WIN32
+        SetConsoleCursorPosition(hConsole, {0, (SHORT)(term_rows-2)});
+#else
+        printf("\033[%d;1H\033[K", term_rows - 1);
+#endif
+        
+        if (!suggestions.empty()) {
+            for (int k = 0; k < (int)suggestions.size(); k++) {
+                std::cout << (k == complete_pick ? "\033[7m " : "\033[2m ") << suggestions[k] << " \033[0m";
+            }
+        } else if (!status_msg.empty() && time(nullptr) - status_msg_time < 3) {
+            std::cout << "\033[7m" << status_msg << "\033[0m";
+        }
+        
+#ifdef _WIN32
+        SetConsoleCursorPosition(hConsole, {0, (SHORT)(term_rows-1)});
+#else
+        printf("\033[%d;1H\033[K", term_rows);
+#endif
+        
+        printf(STATUS_LINE, cursor_y + 1, cursor_x + 1, mode_str.c_str());
+        
+        int display_line = cursor_display_line - top_line + 2;
+        int display_col = cursor_x - chars_before_cursor + 8;
+        
+        if (display_line >= 2 && display_line <= visible_lines + 1) {
+#ifdef _WIN32
+            SetConsoleCursorPosition(hConsole, {(SHORT)(display_col), (SHORT)(display_line-1)});
+#else
+            printf("\033[%d;%dH", display_line, display_col);
+#endif
+        }
+        
+        std::cout.flush();
+    }
+    
+    bool bracket_match(int& by, int& bx, int& my, int& mx) {
+        const Line& line = lines[cursor_y];
+        by = cursor_y;
+        bx = cursor_x < (int)line.length() && is_bracket(line[cursor_x]) ? cursor_x : cursor_x - 1;
+        if (bx < 0 || bx >= (int)line.length() || !is_bracket(line[bx])) return false;
+        return brackets.match(lines, grammar ? grammar->spec : nullptr, by, bx, my, mx);
+    }
+    
+    void jump_bracket() {
+        int by, bx, my, mx;
+        if (!bracket_match(by, bx, my, mx)) {
+            msg("No matching bracket");
+            return;
+        }
+        if (sel_y >= 0) redraw = true;
+        cursor_y = my;
+        cursor_x = mx;
+        msg("Matching bracket at line " + std::to_string(my + 1));
+    }
+    
+    void suggest() {
+        suggestions.clear();
+        complete_pick = -1;
+        if (near_cap()) return;
+        const GrammarSpec* spec = grammar ? grammar->spec : nullptr;
+        const std::string& line = lines[cursor_y];
+        int x = std::min(cursor_x, (int)line.length()), start = x;
+        while (start > 0 && is_word_char(line[start - 1], spec)) start--;
+        while (start < x && !(std::isalpha((unsigned char)line[start]) || line[start] == '_')) start++;
+        if (x - start < 2 || (x < (int)line.length() && is_word_char(line[x], spec))) return;
+        words.sync(lines, spec);
+        suggestions = words.top(line.substr(start, x - start), 5);
+        complete_start = start;
+    }
+    
+    void complete() {
+        if (suggestions.empty()) suggest();
+        if (suggestions.empty()) {
+            msg("No completions");
+            return;
+        }
+        complete_pick = (complete_pick + 1) % suggestions.size();
+        const std::string& word = suggestions[complete_pick];
+        int x = std::min(cursor_x, (int)lines[cursor_y].length());
+        if (complete_start > x || lines[cursor_y].length() - (x - complete_start) + word.length() >= MAX_LINE_LENGTH) return;
+        save_state();
+        lines[cursor_y].mut().replace(complete_start, x - complete_start, word);
+        edited(cursor_y);
+        cursor_x = complete_start + word.length();
+        modified = true;
+    }
+    
+    void sav() {
+        if (disk_changed()) {
+            static time_t last_save = 0;
+            if (time(nullptr) - last_save >= 2) {
+                last_save = time(nullptr);
+                msg("Warning: File changed on disk! Press Ctrl+S again to overwrite.");
+                return;
+            }
+        }
+        
+        if (compressed) {
+            if (stream_state) {
+                msg("Still inflating " + filename + ", save when it has loaded");
+                return;
+            }
+            if (partial) {
+                msg("Not saving: " + filename + " was only partly inflated");
+                return;
+            }
+            if (!save_compressed()) {
+                msg("Error: Cannot save file through gzip!");
+                return;
+            }
+        } else {
+            std::ofstream file(filename, std::ios::out | std::ios::binary);
+            if (!file.is_open()) {
+                msg("Error: Cannot save file!");
+                return;
+            }
+            
+            const char* eol = crlf ? "\r\n" : "\n";
+            if (bom) file << "\xEF\xBB\xBF";
+            for (size_t i = 0; i < lines.size(); i++) {
+                file << lines[i].str();
+                if (i < lines.size() - 1) file << eol;
+            }
+            file.close();
+        }
+        
+        record_disk();
+        for (auto& line : lines) line.set_marks(0);
+        redraw = true;
+        msg("File saved! (" + std::to_string(lines.size()) + " lines)");
+        modified = false;
+    }
+    
+    bool save_compressed() {
+#ifdef _WIN32
+        return false;
+#else
+        struct stat st;
+        std::string tmp = filename + ".sac~";
+        int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) return false;
+        if (stat(filename.c_str(), &st) == 0) fchmod(out, st.st_mode & 07777);
+        
+        int fds[2];
+        pid_t pid = -1;
+        if (cloexec_pipe(fds)) {
+            pid = run_gzip("-c", fds[0], out, nullptr);
+            close(fds[0]);
+            if (pid < 0) close(fds[1]);
+        }
+        close(out);
+        FILE* pipe_out = pid > 0 ? fdopen(fds[1], "w") : nullptr;
+        if (pid > 0 && !pipe_out) close(fds[1]);
+        
+        bool ok = pipe_out != nullptr;
+        const char* eol = crlf ? "\r\n" : "\n";
+        if (ok && bom) ok = fwrite("\xEF\xBB\xBF", 1, 3, pipe_out) == 3;
+        for (size_t i = 0; ok && i < lines.size(); i++) {
+            const std::string& text = lines[i].str();
+            ok = fwrite(text.data(), 1, text.size(), pipe_out) == text.size() && (i + 1 == lines.size() || fputs(eol, pipe_out) >= 0);
+        }
+        if (pipe_out && fclose(pipe_out) != 0) ok = false;
+        
+        int status = -1;
+        if (pid > 0) waitpid(pid, &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 && rename(tmp.c_str(), filename.c_str()) == 0;
+        if (!ok) unlink(tmp.c_str());
+        return ok;
+#endif
+    }
+    
+    void record_disk() {
+        struct stat st;
+        if (stat(filename.c_str(), &st) == 0) {
+            disk_size = follow_offset = st.st_size;
+            disk_mtime = st.st_mtime;
+            follow_ino = st.st_ino;
+        } else {
+            disk_size = follow_offset = follow_ino = 0;
+            disk_mtime = 0;
+        }
+        disk_chunks = chunk_lines(lines);
+    }
+    
+    void diff_disk() {
+        if (compressed) {
+            msg("Diff is not available for compressed files");
+            return;
+        }
+        std::ifstream file(filename, std::ios::in | std::ios::binary);
+        if (!file) {
+            msg("Cannot diff: file is not on disk");
+            return;
+        }
+        std::string disk;
+        file.seekg(0, std::ios::end);
+        disk.resize(file.tellg());
+        file.seekg(0);
+        file.read(&disk[0], disk.size());
+        disk.resize(file.gcount());
+        file.close();
+        
+        size_t count = std::count(disk.begin(), disk.end(), '\n') + 1;
+        std::vector<size_t> starts;
+        std::vector<uint64_t> a, b;
+        starts.reserve(count + 1);
+        a.reserve(count);
+        for (size_t start = bom_length(disk.data(), disk.size());; ) {
+            const char* nl = (const char*)memchr(disk.data() + start, '\n', disk.size() - start);
+            size_t end = nl ? nl - disk.data() : disk.size();
+            size_t len = nl ? line_length(disk.data() + start, end - start) : end - start;
+            starts.push_back(start);
+            a.push_back(line_hash(disk.data() + start, std::min<size_t>(len, MAX_LINE_LENGTH)));
+            if (!nl) break;
+            start = end + 1;
+        }
+        starts.push_back(disk.size() + 1);
+        b.reserve(lines.size());
+        for (const auto& line : lines) b.push_back(line.hash());
+        
+        std::vector<int> v;
+        std::vector<DiffRun> runs;
+        diff_hashes(a.data(), a.size(), b.data(), b.size(), 0, 0, v, runs);
+        runs.push_back({(int)a.size(), (int)b.size(), 0});
+        
+        diff_view.clear();
+        diff_goto.clear();
+        auto emit = [&](const std::string& text, int y) {
+            diff_view.push_back(text);
+            diff_goto.push_back(std::min<int>(y, lines.size() - 1));
+        };
+        auto disk_line = [&](int i) {
+            size_t len = starts[i + 1] - 1 - starts[i];
+            if (starts[i + 1] <= disk.size()) len = line_length(disk.data() + starts[i], len);
+            return disk.substr(starts[i], std::min<size_t>(len, MAX_LINE_LENGTH));
+        };
+        
+        const int context = 3;
+        int added = 0, removed = 0, hunks = 0;
+        emit("--- " + filename + " (disk)", 0);
+        emit("+++ " + filename + " (buffer)", 0);
+        int pa = 0, pb = 0;
+        for (size_t r = 0; r < runs.size(); ) {
+            if (runs[r].a == pa && runs[r].b == pb) {
+                pa += runs[r].len;
+                pb += runs[r].len;
+                r++;
+                continue;
+            }
+            int ha = std::max(0, pa - context), hb = std::max(0, pb - context);
+            size_t at = diff_view.size();
+            emit("", pb);
+            for (int i = ha; i < pa; i++) emit(" " + disk_line(i), hb + i - ha);
+            int ea = pa, eb = pb;
+            while (true) {
+                for (; ea < runs[r].a; ea++, removed++) emit("-" + disk_line(ea), runs[r].b);
+                for (; eb < runs[r].b; eb++, added++) emit("+" + lines[eb].str(), eb);
+                int len = runs[r].len;
+                while (r + 1 < runs.size() && runs[r + 1].a == runs[r].a + len && runs[r + 1].b == runs[r].b + len) len += runs[++r].len;
+                if (r + 1 < runs.size() && len <= 2 * context) {
+                    for (int i = 0; i < len; i++) emit(" " + disk_line(ea + i), eb + i);
+                    ea += len;
+                    eb += len;
+                    r++;
+                    continue;
+                }
+                int tail = std::min(len, context);
+                for (int i = 0; i < tail; i++) emit(" " + disk_line(ea + i), eb + i);
+                diff_view[at] = "@@ -" + std::to_string(ha + 1) + "," + std::to_string(ea + tail - ha) +
+                                " +" + std::to_string(hb + 1) + "," + std::to_string(eb + tail - hb) + " @@";
+                pa = ea + len;
+                pb = eb + len;
+                r++;
+                break;
+            }
+            hunks++;
+        }
+        
+        if (hunks == 0) {
+            msg("No differences from disk");
+            return;
+        }
+        diff_top = 0;
+        show_diff = true;
+        msg(std::to_string(hunks) + " hunks, +" + std::to_string(added) + " -" + std::to_string(removed) + " lines");
+    }
+    
+    void dif() {
+        clr();
+        std::cout << "\033[1;37m  SAC++ Editor - Diff against disk: " << status_msg << " \033[0m\n";
+        int rows = term_rows - 2;
+        for (int i = diff_top; i < diff_top + rows && i < (int)diff_view.size(); i++) {
+            const std::string& text = diff_view[i];
+            const char* color = text.compare(0, 2, "@@") == 0 ? "\033[36m" : i < 2 ? "\033[1m" :
+                                text[0] == '+' ? "\033[32m" : text[0] == '-' ? "\033[31m" : "";
+            std::cout << color << text.substr(0, term_cols - 1) << "\033[0m\n";
+        }
+        printf("\033[%d;1H\033[1;33m  Arrows/PgUp/PgDn scroll, Enter jumps to line, other keys return\033[0m", term_rows);
+        std::cout.flush();
+    }
+    
+    void diff_key(char ch) {
+        int page = std::max(1, term_rows - 3), last = std::max(0, (int)diff_view.size() - (term_rows - 2));
+        if (ch == 27) {
+            char seq[3] = {0, 0, 0};
+            if (read_key(seq[0]) && read_key(seq[1]) && seq[0] == '[') {
+                if (seq[1] == '5' || seq[1] == '6') read_key(seq[2]);
+                int step = seq[1] == 'A' ? -1 : seq[1] == 'B' ? 1 : seq[1] == '5' ? -page : seq[1] == '6' ? page : 0;
+                if (step) {
+                    diff_top = std::max(0, std::min(last, diff_top + step));
+                    return;
+                }
+            }
+        } else if (ch == '\r' || ch == '\n') {
+            int row = std::min<int>(std::max(diff_top, 2), diff_goto.size() - 1);
+            cursor_y = diff_goto[row];
+            cursor_x = 0;
+            adj();
+        }
+        show_diff = false;
+        diff_view.clear();
+        diff_goto.clear();
+        redraw = true;
+    }
+    
+    void search_files() {
+#ifdef _WIN32
+        msg("Project search is not supported on this platform");
+#else
+        std::string term;
+        if (!prompt("Search files for (empty: last results): ", term)) {
+            msg("Search cancelled");
             return;
         }
-        
-        if (show_credits) {
-            crd();
+        if (term.empty()) {
+            if (results.empty() && !search_state) msg("No previous search");
+            else show_results = true;
             return;
         }
         
-        sz();
+        stop_search();
+        results.clear();
+        results_term = term;
+        results_top = results_pick = 0;
+        results_files = 0;
+        std::shared_ptr<SearchState> state = std::make_shared<SearchState>();
+        if (!state->wake.open()) {
+            msg("Cannot start search");
+            return;
+        }
+        search_state = state;
+        search_thread = std::thread([state, term]() {
+            std::vector<std::string> files;
+            walk_tree("", load_ignores(), files, state->cancel);
+            {
+                std::lock_guard<std::mutex> guard(state->lock);
+                state->total = files.size();
+            }
+            parallel_for(files.size(), [&](size_t i) {
+                if (!state->cancel) search_file(files[i], term, *state);
+            });
+            std::lock_guard<std::mutex> guard(state->lock);
+            state->done = true;
+            state->wake.notify();
+        });
+        show_results = true;
+        msg("Searching...");
+#endif
+    }
+    
+    void stop_search() {
+        if (!search_state) return;
+        search_state->cancel = true;
+        search_thread.join();
+        search_state.reset();
+    }
+    
+    void search_update() {
+        bool done;
+        size_t searched, total;
+        {
+            search_state->wake.drain();
+            std::lock_guard<std::mutex> guard(search_state->lock);
+            std::vector<SearchHit>& hits = search_state->hits;
+            size_t take = std::min(hits.size(), SEARCH_MAX_HITS - std::min<size_t>(results.size(), SEARCH_MAX_HITS));
+            results.insert(results.end(), std::make_move_iterator(hits.begin()), std::make_move_iterator(hits.begin() + take));
+            hits.clear();
+            if (results.size() >= SEARCH_MAX_HITS) search_state->cancel = true;
+            done = search_state->done;
+            searched = search_state->searched;
+            total = search_state->total;
+        }
+        results_files = searched;
+        if (done) {
+            stop_search();
+            msg(std::to_string(results.size()) + " matches in " + std::to_string(searched) + " files");
+        } else {
+            msg("Searching... " + std::to_string(results.size()) + " matches, " + std::to_string(searched) +
+                (total ? "/" + std::to_string(total) : "") + " files");
+        }
+    }
+    
+    void res() {
         clr();
-        
-        char mod_indicator = modified ? '*' : ' ';
-        std::string mode_str = insert_mode ? "INS" : "OVR";
-        
+        std::cout << "\033[1;37m  SAC++ Editor - Search \"" << results_term << "\": " << status_msg << " \033[0m\n";
+        int rows = term_rows - 2;
+        for (int i = results_top; i < results_top + rows && i < (int)results.size(); i++) {
+            const SearchHit& hit = results[i];
+            std::string where = hit.path + ":" + std::to_string(hit.line + 1) + ": ";
+            std::string text = hit.text;
+            std::replace(text.begin(), text.end(), '\t', ' ');
+            std::replace(text.begin(), text.end(), '\r', ' ');
+            std::string row = (where + text).substr(0, term_cols - 1);
+            if (i == results_pick) std::cout << "\033[7m" << row << "\033[0m\n";
+            else std::cout << "\033[36m" << row.substr(0, std::min(row.size(), where.size())) << "\033[0m" << row.substr(std::min(row.size(), where.size())) << "\n";
+        }
+        printf("\033[%d;1H\033[1;33m  Arrows/PgUp/PgDn select, Enter opens the match, other keys return\033[0m", term_rows);
+        std::cout.flush();
+    }
+    
+    void results_key(char ch) {
+        int rows = std::max(1, term_rows - 2), count = results.size();
+        if (ch == 27) {
+            char seq[3] = {0, 0, 0};
+            if (read_key(seq[0]) && read_key(seq[1]) && seq[0] == '[') {
+                if (seq[1] == '5' || seq[1] == '6') read_key(seq[2]);
+                int step = seq[1] == 'A' ? -1 : seq[1] == 'B' ? 1 : seq[1] == '5' ? -rows : seq[1] == '6' ? rows : 0;
+                if (step) {
+                    results_pick = std::max(0, std::min(count - 1, results_pick + step));
+                    if (results_pick < results_top) results_top = results_pick;
+                    if (results_pick >= results_top + rows) results_top = results_pick - rows + 1;
+                    return;
+                }
+            }
+        } else if ((ch == '\r' || ch == '\n') && results_pick < count) {
+            show_results = false;
+            open_result(results[results_pick]);
+            return;
+        }
+        show_results = false;
+        redraw = true;
+    }
+    
+    void open_result(const SearchHit& hit) {
+        struct stat a, b;
+        bool same = stat(filename.c_str(), &a) == 0 && stat(hit.path.c_str(), &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        if (!same) {
+            if (stream_state) {
+                msg("Wait for " + filename + " to finish loading");
+                redraw = true;
+                return;
+            }
+            if (modified) {
+                msg("Save changes before opening " + hit.path);
+                redraw = true;
+                return;
+            }
+            save_session();
+            load_file(hit.path);
+        }
+        sel_y = -1;
+        cursor_y = std::min<int>(hit.line, lines.size() - 1);
+        cursor_x = std::min<int>(hit.col, lines[cursor_y].length());
+        reveal(cursor_y);
+        adj();
+        redraw = true;
+        msg(hit.path + ":" + std::to_string(hit.line + 1) + " (F8 then Enter for the result list)");
+    }
+    
+    bool looks_binary(const std::string& fname) {
+        std::ifstream file(fname, std::ios::in | std::ios::binary);
+        if (!file) return false;
+        char head[BINARY_SNIFF];
+        file.read(head, sizeof(head));
+        return !gzip_magic(head, file.gcount()) && memchr(head, 0, file.gcount()) != nullptr;
+    }
+    
+    bool open_hex(const std::string& fname) {
+        close_hex();
 #ifdef _WIN32
-        SetConsoleCursorPosition(hConsole, {0, 0});
+        std::ifstream file(fname, std::ios::in | std::ios::binary);
+        if (!file) {
+            msg("Cannot open file - permission denied");
+            return false;
+        }
+        hex_buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        hex_data = hex_buffer.data();
+        hex_size = hex_buffer.size();
+#else
+        int fd = open(fname.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            msg("Cannot open file - permission denied");
+            return false;
+        }
+        if (st.st_size > 0) {
+            void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                msg("Cannot map file for hex view");
+                return false;
+            }
+            hex_data = (const uint8_t*)data;
+            hex_size = st.st_size;
+        }
+        close(fd);
+#endif
+        filename = fname;
+        hex_mode = true;
+        hex_ascii = hex_low = false;
+        hex_cursor = hex_top = 0;
+        lines = {""};
+        words.reset();
+        reshaped(0);
+        grammar = nullptr;
+        record_disk();
+        cursor_x = cursor_y = top_line = 0;
+        modified = false;
+        redraw = true;
+        msg("Hex view: " + std::to_string(hex_size) + " bytes (Tab switches hex/ASCII)");
+        return true;
+    }
+    
+    void close_hex() {
+#ifdef _WIN32
+        hex_buffer.clear();
+        hex_buffer.shrink_to_fit();
+#else
+        if (hex_data) munmap((void*)hex_data, hex_size);
 #endif
-        std::cout << "\033[1;36m~ SAC++: " << filename << " " << mod_indicator << " ~\033[0m\n";
+        hex_data = nullptr;
+        hex_size = 0;
+        hex_edits.clear();
+        hex_undo.clear();
+        hex_mode = false;
+    }
+    
+    uint8_t hex_byte(size_t offset) {
+        auto it = hex_edits.find(offset);
+        return it != hex_edits.end() ? it->second : hex_data[offset];
+    }
+    
+    void set_byte(size_t offset, uint8_t value) {
+        auto it = hex_edits.find(offset);
+        hex_undo.push_back({offset, it != hex_edits.end() ? it->second : -1});
+        if (value != hex_data[offset]) hex_edits[offset] = value;
+        else if (it != hex_edits.end()) hex_edits.erase(it);
+        modified = !hex_edits.empty();
+    }
+    
+    void hex_drw() {
+        int prev_rows = term_rows, prev_cols = term_cols;
+        sz();
+        if (redraw || term_rows != prev_rows || term_cols != prev_cols) clr();
+        redraw = false;
         
-        std::vector<std::string> display_lines;
-        std::vector<int> line_mapping;
+        size_t rows = visible_lines, row = hex_cursor / HEX_WIDTH, col = hex_cursor % HEX_WIDTH;
+        if (row < hex_top) hex_top = row;
+        if (row >= hex_top + rows) hex_top = row - rows + 1;
         
-        for (int i = 0; i < (int)lines.size(); i++) {
-            auto wrapped = wrap_line(lines[i], term_cols - 7);
-            for (const auto& wrap : wrapped) {
-                display_lines.push_back(wrap);
-                line_mapping.push_back(i);
+        std::string out = "\033[H\033[1;36m~ SAC++: " + filename + " " + (modified ? '*' : ' ') + " ~\033[0m\033[K\n";
+        char cell[24];
+        for (size_t r = 0; r < rows; r++) {
+            size_t offset = (hex_top + r) * HEX_WIDTH;
+            if (offset >= hex_size) {
+                out += "\033[K\n";
+                continue;
+            }
+            snprintf(cell, sizeof(cell), "%010zx  ", offset);
+            out += "\033[2m";
+            out += cell;
+            out += "\033[0m";
+            std::string ascii;
+            for (size_t i = 0; i < HEX_WIDTH; i++) {
+                if (i == HEX_WIDTH / 2) out += ' ';
+                if (offset + i >= hex_size) {
+                    out += "   ";
+                    continue;
+                }
+                uint8_t b = hex_byte(offset + i);
+                const char* color = offset + i == hex_cursor ? "\033[7m" : hex_edits.count(offset + i) ? "\033[1;33m" : "";
+                snprintf(cell, sizeof(cell), "%02x", b);
+                out += color;
+                out += cell;
+                out += *color ? "\033[0m " : " ";
+                ascii += color;
+                ascii += b >= 32 && b <= 126 ? (char)b : '.';
+                if (*color) ascii += "\033[0m";
             }
+            out += " |" + ascii + "|\033[K\n";
         }
+        std::cout << out;
         
-        int cursor_display_line = 0;
-        int chars_before_cursor = 0;
-        for (int i = 0; i < cursor_y; i++) {
-            auto wrapped = wrap_line(lines[i], term_cols - 7);
-            cursor_display_line += wrapped.size();
+        printf("\033[%d;1H\033[K", term_rows - 1);
+        if (!status_msg.empty() && time(nullptr) - status_msg_time < 3) {
+            std::cout << "\033[7m" << status_msg << "\033[0m";
         }
+        printf("\033[%d;1H\033[K", term_rows);
+        printf(HEX_STATUS, hex_cursor, hex_size, hex_ascii ? "ASCII" : "HEX");
         
-        auto current_wrapped = wrap_line(lines[cursor_y], term_cols - 7);
-        for (int i = 0; i < (int)current_wrapped.size(); i++) {
-            if (chars_before_cursor + (int)current_wrapped[i].length() >= cursor_x) {
-                cursor_display_line += i;
-                break;
+        int display_col = hex_ascii ? 13 + HEX_WIDTH * 3 + 3 + col : 13 + col * 3 + (col >= HEX_WIDTH / 2) + hex_low;
+        printf("\033[%d;%dH", (int)(row - hex_top) + 2, display_col);
+        std::cout.flush();
+    }
+    
+    void hex_move(long long delta) {
+        if (hex_size == 0) return;
+        long long target = (long long)hex_cursor + delta;
+        hex_cursor = std::max(0LL, std::min<long long>(hex_size - 1, target));
+        hex_low = false;
+    }
+    
+    void hex_goto() {
+        std::string answer;
+        if (!prompt("Go to offset: ", answer) || answer.empty()) return;
+        char* end;
+        unsigned long long offset = strtoull(answer.c_str(), &end, 0);
+        if (*end || offset >= hex_size) {
+            msg("Offset out of range");
+            return;
+        }
+        hex_cursor = offset;
+        hex_low = false;
+    }
+    
+    void hex_undo_edit() {
+        if (hex_undo.empty()) {
+            msg("Nothing to undo");
+            return;
+        }
+        std::pair<size_t, int> last = hex_undo.back();
+        hex_undo.pop_back();
+        if (last.second < 0) hex_edits.erase(last.first);
+        else hex_edits[last.first] = last.second;
+        hex_cursor = last.first;
+        hex_low = false;
+        modified = !hex_edits.empty();
+    }
+    
+    void hex_save() {
+        if (hex_edits.empty()) {
+            msg("No changes to save");
+            return;
+        }
+        std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+        std::string run;
+        for (auto it = hex_edits.begin(); file && it != hex_edits.end();) {
+            size_t start = it->first;
+            run.clear();
+            for (; it != hex_edits.end() && it->first == start + run.size(); ++it) run += (char)it->second;
+            file.seekp(start);
+            file.write(run.data(), run.size());
+        }
+        if (!file.flush()) {
+            msg("Error: Cannot save file!");
+            return;
+        }
+        file.close();
+#ifdef _WIN32
+        for (auto& edit : hex_edits) hex_buffer[edit.first] = edit.second;
+#endif
+        size_t count = hex_edits.size();
+        hex_edits.clear();
+        hex_undo.clear();
+        modified = false;
+        record_disk();
+        msg("Saved " + std::to_string(count) + " changed bytes in place");
+    }
+    
+    void hex_inp(char ch) {
+        long long page = (long long)std::max(1, visible_lines) * HEX_WIDTH;
+        if (ch == 27) {
+            char c;
+            std::string params;
+            if (!read_key(c) || c != '[') return;
+            while (read_key(c) && c >= 0x20 && c < 0x40) params += c;
+            if (c == 'A') hex_move(-HEX_WIDTH);
+            else if (c == 'B') hex_move(HEX_WIDTH);
+            else if (c == 'C') hex_move(1);
+            else if (c == 'D') hex_move(-1);
+            else if (c == 'H') hex_move(-(long long)(hex_cursor % HEX_WIDTH));
+            else if (c == 'F') hex_move(HEX_WIDTH - 1 - hex_cursor % HEX_WIDTH);
+            else if (c == '~' && params == "5") hex_move(-page);
+            else if (c == '~' && params == "6") hex_move(page);
+        } else if (ch == 17) {
+            quit();
+        } else if (ch == 19) {
+            hex_save();
+        } else if (ch == 21) {
+            hex_undo_edit();
+        } else if (ch == 12) {
+            hex_goto();
+        } else if (ch == 7) {
+            show_guide = true;
+        } else if (ch == 14) {
+            show_credits = true;
+        } else if (ch == 5) {
+            show_memory = true;
+        } else if (ch == 28) {
+            record_macro();
+        } else if (ch == 31) {
+            play_macro();
+        } else if (ch == 9) {
+            hex_ascii = !hex_ascii;
+            hex_low = false;
+        } else if (ch == 127 || ch == 8) {
+            hex_move(-1);
+        } else if (ch >= 32 && ch <= 126 && hex_size > 0) {
+            if (hex_ascii) {
+                set_byte(hex_cursor, ch);
+                hex_move(1);
+            } else if (isxdigit((unsigned char)ch)) {
+                uint8_t nibble = isdigit((unsigned char)ch) ? ch - '0' : (tolower(ch) - 'a' + 10);
+                uint8_t b = hex_byte(hex_cursor);
+                set_byte(hex_cursor, hex_low ? (b & 0xf0) | nibble : (nibble << 4) | (b & 0x0f));
+                if (hex_low) hex_move(1);
+                else hex_low = true;
             }
-            chars_before_cursor += current_wrapped[i].length();
         }
-        
-        if (cursor_display_line < top_line) {
-            top_line = cursor_display_line;
+    }
+    
+    bool disk_changed() {
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0) return false;
+        return (uint64_t)st.st_size != disk_size || (int64_t)st.st_mtime != disk_mtime;
+    }
+    
+    void reload_changed() {
+        if (!disk_changed()) return;
+        if (following) {
+            follow_update();
+            return;
         }
-        if (cursor_display_line >= top_line + visible_lines) {
-            top_line = cursor_display_line - visible_lines + 1;
+        if (modified) {
+            msg("Warning: File changed on disk! Save will ask before overwriting.");
+            return;
         }
-        if (top_line < 0) top_line = 0;
-        if (top_line > (int)display_lines.size() - visible_lines) {
-            top_line = std::max(0, (int)display_lines.size() - visible_lines);
+        if (compressed) {
+            if (!stream_state) {
+                reset_file_state();
+                open_file(filename);
+            }
+            return;
+        }
+        if (hex_mode) {
+            size_t at = hex_cursor;
+            if (open_hex(filename)) hex_cursor = std::min(at, hex_size ? hex_size - 1 : 0);
+            return;
         }
         
-        int start_line = top_line;
-        int end_line = std::min(start_line + visible_lines, (int)display_lines.size());
+        std::ifstream file(filename, std::ios::in | std::ios::binary);
+        if (!file) return;
+        std::string buffer;
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        file.close();
         
-        for (int i = start_line; i < end_line; i++) {
-            int original_line = (i < (int)line_mapping.size()) ? line_mapping[i] : 0;
-            std::cout << "\033[0;37m" << std::setw(4) << (original_line + 1) << " |\033[0m ";
-            
-            if (i < (int)display_lines.size()) {
-                highlight_line(display_lines[i], term_cols - 7);
+        Lines fresh;
+        detect_format(buffer.data(), std::min<size_t>(buffer.size(), 4096));
+        size_t start = bom_length(buffer.data(), buffer.size());
+        for (size_t i = start; i <= buffer.size(); ++i) {
+            if (i == buffer.size() || buffer[i] == '\n') {
+                size_t len = i < buffer.size() ? line_length(&buffer[start], i - start) : i - start;
+                fresh.push_back(buffer.substr(start, std::min<size_t>(len, MAX_LINE_LENGTH)));
+                start = i + 1;
             }
-            std::cout << "\n";
-        }
-        
-        for (int i = end_line; i < start_line + visible_lines; i++) {
-            std::cout << "\033[1;37m" << std::setw(4) << (i + 1) << " |\033[0m\n";
         }
+        DiskChunks chunks = chunk_lines(fresh);
         
-        scrbar();
+        std::vector<size_t> old_at(1, 0), new_at(1, 0);
+        for (const auto& chunk : disk_chunks) old_at.push_back(old_at.back() + chunk.lines);
+        for (const auto& chunk : chunks) new_at.push_back(new_at.back() + chunk.lines);
+        if (old_at.back() != lines.size()) return;
+        std::unordered_map<uint64_t, std::vector<size_t>> where;
+        for (size_t j = 0; j < chunks.size(); j++) where[chunks[j].hash].push_back(j);
         
-#ifdef _WIN32
-        SetConsoleCursorPosition(hConsole, {0, (SHORT)(term_rows-2)});
-#else
-        printf("\033[%d;1H", term_rows - 1);
-#endif
+        std::vector<DiskHunk> hunks;
+        size_t i = 0, j = 0;
+        while (i < disk_chunks.size() || j < chunks.size()) {
+            if (i < disk_chunks.size() && j < chunks.size() && disk_chunks[i] == chunks[j]) {
+                i++;
+                j++;
+                continue;
+            }
+            size_t si = i, sj = chunks.size();
+            for (; si < disk_chunks.size(); si++) {
+                auto it = where.find(disk_chunks[si].hash);
+                if (it == where.end()) continue;
+                auto pos = std::lower_bound(it->second.begin(), it->second.end(), j);
+                if (pos != it->second.end() && chunks[*pos] == disk_chunks[si]) {
+                    sj = *pos;
+                    break;
+                }
+            }
+            hunks.push_back({old_at[i], old_at[si], new_at[j], new_at[sj]});
+            i = si;
+            j = sj;
+        }
         
-        if (!status_msg.empty() && time(nullptr) - status_msg_time < 3) {
-            std::cout << "\033[7m" << status_msg << "\033[0m";
+        save_state();
+        sel_y = -1;
+        int target = cursor_y;
+        for (const auto& h : hunks) {
+            if ((size_t)cursor_y >= h.old_end) {
+                target += (int)(h.new_end - h.new_start) - (int)(h.old_end - h.old_start);
+            } else {
+                if ((size_t)cursor_y >= h.old_start)
+                    target = h.new_start + std::min<int>(cursor_y - h.old_start, std::max<int>(0, h.new_end - h.new_start - 1));
+                break;
+            }
         }
+        for (auto h = hunks.rbegin(); h != hunks.rend(); ++h) {
+            lines.erase(lines.begin() + h->old_start, lines.begin() + h->old_end);
+            lines.insert(lines.begin() + h->old_start, std::make_move_iterator(fresh.begin() + h->new_start),
+                         std::make_move_iterator(fresh.begin() + h->new_end));
+        }
+        reshaped(hunks.empty() ? lines.size() : hunks.front().old_start);
         
-#ifdef _WIN32
-        SetConsoleCursorPosition(hConsole, {0, (SHORT)(term_rows-1)});
-#else
-        printf("\033[%d;1H", term_rows);
-#endif
+        cursor_y = std::max(0, std::min(target, (int)lines.size() - 1));
+        if (cursor_x > (int)lines[cursor_y].length()) cursor_x = lines[cursor_y].length();
         
-        printf(STATUS_LINE, cursor_y + 1, cursor_x + 1, mode_str.c_str());
+        record_disk();
+        adj();
+        msg("Reloaded " + std::to_string(hunks.size()) + " region(s) changed on disk");
+    }
+    
+    void save_session() {
+        session_dirty = false;
+        if (hex_mode || compressed) return;
+        std::string path = cache_path(filename, ".ses");
+        if (path.empty()) return;
         
-        int display_line = cursor_display_line - top_line + 2;
-        int display_col = cursor_x - chars_before_cursor + 8;
+        std::string out("SACSES", 7);
+        out += (char)SESSION_VERSION;
+        put_varint(out, disk_size);
+        put_varint(out, (uint64_t)disk_mtime);
+        put_varint(out, lines.size());
+        put_varint(out, cursor_x);
+        put_varint(out, cursor_y);
+        put_varint(out, top_line);
+        put_text(out, find_term);
         
-        if (display_line >= 2 && display_line <= visible_lines + 1) {
-#ifdef _WIN32
-            SetConsoleCursorPosition(hConsole, {(SHORT)(display_col), (SHORT)(display_line-1)});
-#else
-            printf("\033[%d;%dH", display_line, display_col);
-#endif
+        std::unordered_map<const void*, uint64_t> pooled;
+        std::string pool, history;
+        size_t kept = modified ? 0 : undo_stack.size();
+        for (size_t i = undo_stack.size(); i-- > undo_stack.size() - kept; ) {
+            EditorState& state = undo_stack[i];
+            const Line* next = i + 1 < undo_stack.size() ? undo_stack[i + 1].lines.data() : lines.data();
+            size_t n = state.lines.size(), m = i + 1 < undo_stack.size() ? undo_stack[i + 1].lines.size() : lines.size();
+            size_t head = state.keep_head, tail = state.keep_tail;
+            if (head == SIZE_MAX || i + 1 == undo_stack.size()) {
+                for (head = 0; head < n && head < m && state.lines[head].same(next[head]); head++) {}
+                for (tail = 0; tail < n - head && tail < m - head && state.lines[n - 1 - tail].same(next[m - 1 - tail]); tail++) {}
+                if (i + 1 < undo_stack.size()) {
+                    state.keep_head = head;
+                    state.keep_tail = tail;
+                }
+            }
+            put_varint(history, state.cursor_x);
+            put_varint(history, state.cursor_y);
+            put_varint(history, head);
+            put_varint(history, tail);
+            put_varint(history, n - head - tail);
+            for (size_t k = head; k < n - tail; k++) {
+                auto slot = pooled.emplace(state.lines[k].id(), pooled.size());
+                if (slot.second) put_text(pool, state.lines[k]);
+                put_varint(history, slot.first->second);
+            }
         }
+        put_varint(out, pooled.size());
+        out += pool;
+        put_varint(out, kept);
+        out += history;
         
-        std::cout.flush();
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(out.data(), out.size());
     }
     
-    void sav() {
-        std::ofstream file(filename);
-        if (!file.is_open()) {
-            msg("Error: Cannot save file!");
-            return;
+    void restore_session() {
+        std::string path = cache_path(filename, ".ses");
+        if (path.empty()) return;
+        std::ifstream file(path, std::ios::binary);
+        std::string in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (in.size() < 8 || in.compare(0, 7, std::string("SACSES", 7)) != 0 || in[7] != SESSION_VERSION) return;
+        
+        size_t pos = 8;
+        uint64_t size, mtime, count, x, y, top, entries;
+        std::string term;
+        if (!get_varint(in, pos, size) || !get_varint(in, pos, mtime) || !get_varint(in, pos, count)) return;
+        if (size != disk_size || (int64_t)mtime != disk_mtime || count != lines.size()) return;
+        if (!get_varint(in, pos, x) || !get_varint(in, pos, y) || !get_varint(in, pos, top) || !get_text(in, pos, term)) return;
+        if (!get_varint(in, pos, entries) || entries > in.size()) return;
+        
+        std::vector<Line> pool(entries);
+        std::string text;
+        for (auto& line : pool) {
+            if (!get_text(in, pos, text)) return;
+            line = text;
+            line.set_marks(MARK_CHANGED);
         }
         
-        for (size_t i = 0; i < lines.size(); i++) {
-            file << lines[i];
-            if (i < lines.size() - 1) file << "\n";
+        std::deque<EditorState, Counted<EditorState, MEM_UNDO>> history;
+        const Line* next = lines.data();
+        size_t next_size = lines.size();
+        if (!get_varint(in, pos, entries) || entries > MAX_UNDO_STACK) return;
+        for (uint64_t k = 0; k < entries; k++) {
+            uint64_t sx, sy, head, tail, mid, id;
+            if (!get_varint(in, pos, sx) || !get_varint(in, pos, sy) || !get_varint(in, pos, head) ||
+                !get_varint(in, pos, tail) || !get_varint(in, pos, mid) || head + tail > next_size || mid > in.size()) return;
+            EditorState state;
+            state.cursor_x = sx;
+            state.cursor_y = sy;
+            state.lines.reserve(head + mid + tail);
+            state.lines.insert(state.lines.end(), next, next + head);
+            for (uint64_t j = 0; j < mid; j++) {
+                if (!get_varint(in, pos, id) || id >= pool.size()) return;
+                state.lines.push_back(pool[id]);
+            }
+            state.lines.insert(state.lines.end(), next + next_size - tail, next + next_size);
+            if (state.lines.empty() || sy >= state.lines.size()) return;
+            if (k > 0) {
+                state.keep_head = head;
+                state.keep_tail = tail;
+            }
+            history.push_front(std::move(state));
+            next = history.front().lines.data();
+            next_size = history.front().lines.size();
         }
         
-        file.close();
-        msg("File saved! (" + std::to_string(lines.size()) + " lines)");
-        modified = false;
+        undo_stack = std::move(history);
+        find_term = term;
+        cursor_y = std::min<uint64_t>(y, lines.size() - 1);
+        cursor_x = std::min<uint64_t>(x, lines[cursor_y].length());
+        top_line = top;
+        adj();
+        msg("Session restored (" + std::to_string(undo_stack.size()) + " undo steps)");
+    }
+    
+    void detect_format(const char* head, size_t len) {
+        bom = bom_length(head, len) > 0;
+        const char* nl = (const char*)memchr(head, '\n', len);
+        crlf = nl && nl > head && nl[-1] == '\r';
+    }
+    
+    size_t line_length(const char* text, size_t len) {
+        return crlf && len > 0 && text[len - 1] == '\r' ? len - 1 : len;
     }
     
     bool file_exists(const std::string& fname) {
@@ -793,13 +3098,148 @@ public:
 #endif
     }
     
+    std::string cache_path(const std::string& fname, const std::string& ext) {
+        std::string dir;
+#ifdef _WIN32
+        char full[MAX_PATH];
+        if (!_fullpath(full, fname.c_str(), MAX_PATH)) return "";
+        const char* base = getenv("LOCALAPPDATA");
+        if (!base) return "";
+        dir = std::string(base) + "\\sac++";
+        _mkdir(dir.c_str());
+        dir += "\\";
+#else
+        char full[PATH_MAX];
+        if (!realpath(fname.c_str(), full)) return "";
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        if (xdg && *xdg) {
+            dir = xdg;
+        } else if (home && *home) {
+            dir = std::string(home) + "/.cache";
+        } else {
+            return "";
+        }
+        dir += "/sac++";
+        for (size_t slash = dir.find('/', 1); slash != std::string::npos; slash = dir.find('/', slash + 1)) {
+            mkdir(dir.substr(0, slash).c_str(), 0755);
+        }
+        mkdir(dir.c_str(), 0755);
+        dir += "/";
+#endif
+        char key[17];
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)fnv1a(full, strlen(full)));
+        return dir + key + ext;
+    }
+    
+    uint64_t sample_at(std::ifstream& file, uint64_t offset, uint64_t size) {
+        if (offset + INDEX_SAMPLE > size) offset = size > INDEX_SAMPLE ? size - INDEX_SAMPLE : 0;
+        char buf[INDEX_SAMPLE * 2];
+        uint64_t from = offset >= INDEX_SAMPLE ? offset - INDEX_SAMPLE : 0;
+        uint64_t len = std::min<uint64_t>(offset + INDEX_SAMPLE, size) - from;
+        file.clear();
+        file.seekg(from);
+        file.read(buf, len);
+        return fnv1a(buf, file.gcount());
+    }
+    
+    bool load_index(const std::string& path, LineIndex& idx) {
+        std::ifstream in(path, std::ios::binary);
+        char magic[8];
+        uint64_t count = 0;
+        if (!in.read(magic, 8) || memcmp(magic, "SACIDX1", 8) != 0) return false;
+        in.read((char*)&idx.size, sizeof(idx.size));
+        in.read((char*)&idx.mtime, sizeof(idx.mtime));
+        in.read((char*)&idx.line_count, sizeof(idx.line_count));
+        in.read((char*)&idx.tail_sample, sizeof(idx.tail_sample));
+        in.read((char*)&count, sizeof(count));
+        if (!in || count == 0 || count > idx.size + 1) return false;
+        idx.offsets.resize(count);
+        idx.samples.resize(count);
+        in.read((char*)idx.offsets.data(), count * sizeof(uint64_t));
+        in.read((char*)idx.samples.data(), count * sizeof(uint64_t));
+        return (bool)in;
+    }
+    
+    void save_index(const std::string& path, const LineIndex& idx) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) return;
+        uint64_t count = idx.offsets.size();
+        out.write("SACIDX1", 8);
+        out.write((const char*)&idx.size, sizeof(idx.size));
+        out.write((const char*)&idx.mtime, sizeof(idx.mtime));
+        out.write((const char*)&idx.line_count, sizeof(idx.line_count));
+        out.write((const char*)&idx.tail_sample, sizeof(idx.tail_sample));
+        out.write((const char*)&count, sizeof(count));
+        out.write((const char*)idx.offsets.data(), count * sizeof(uint64_t));
+        out.write((const char*)idx.samples.data(), count * sizeof(uint64_t));
+    }
+    
+    size_t trusted_chunks(std::ifstream& file, const LineIndex& idx, uint64_t size, int64_t mtime) {
+        size_t count = idx.offsets.size();
+        if (idx.size == size && idx.mtime == mtime) {
+            size_t probes[3] = {0, count / 2, count - 1};
+            bool valid = sample_at(file, size, size) == idx.tail_sample;
+            for (size_t p : probes) {
+                if (sample_at(file, idx.offsets[p], size) != idx.samples[p]) valid = false;
+            }
+            if (valid) return count;
+        }
+        
+        size_t matched = 0;
+        while (matched < count && idx.offsets[matched] + INDEX_SAMPLE <= size &&
+               sample_at(file, idx.offsets[matched], size) == idx.samples[matched]) {
+            matched++;
+        }
+        return matched > 0 ? matched - 1 : 0;
+    }
+    
+    bool split_chunk(const std::string& fname, uint64_t from, uint64_t to, size_t first, size_t count, bool last) {
+        std::ifstream file(fname, std::ios::in | std::ios::binary);
+        std::string buffer(to - from, '\0');
+        file.seekg(from);
+        if (!file.read(&buffer[0], buffer.size())) return false;
+        
+        size_t start = 0, n = 0;
+        for (size_t i = 0; i <= buffer.size() && n < count; ++i) {
+            if (i == buffer.size() || buffer[i] == '\n') {
+                size_t len = i < buffer.size() || !last ? line_length(&buffer[start], i - start) : i - start;
+                lines[first + n++] = buffer.substr(start, std::min<size_t>(len, MAX_LINE_LENGTH));
+                start = i + 1;
+            }
+        }
+        return n == count && start >= buffer.size();
+    }
+    
+    bool load_chunks(const std::string& fname, const LineIndex& idx, size_t chunks, uint64_t size) {
+        size_t total = std::min<uint64_t>(chunks * (uint64_t)INDEX_STRIDE, idx.line_count);
+        lines.resize(total);
+        
+        std::atomic<bool> ok(true);
+        parallel_for(chunks, [&](size_t c) {
+            if (!ok) return;
+            bool last = c + 1 == idx.offsets.size();
+            uint64_t to = last ? size : idx.offsets[c + 1] - 1;
+            size_t count = last ? total - c * INDEX_STRIDE : INDEX_STRIDE;
+            if (!split_chunk(fname, idx.offsets[c], to, c * INDEX_STRIDE, count, last)) ok = false;
+        });
+        return ok;
+    }
+    
     void open_file(const std::string& fname) {
         if (!file_exists(fname)) {
+            compressed = false;
             msg("File does not exist, creating new file");
             filename = fname;
             lines = {""};
+            crlf = bom = false;
+            words.reset();
+            reshaped(0);
+            grammar = Grammar::for_file(fname, "");
+            record_disk();
             cursor_x = cursor_y = top_line = 0;
             modified = false;
+            redraw = true;
             return;
         }
 
@@ -808,55 +3248,167 @@ public:
             msg("Cannot open file - permission denied");
             return;
         }
+        
+        struct stat st;
+        stat(fname.c_str(), &st);
+        uint64_t size = st.st_size;
+        int64_t mtime = st.st_mtime;
+        
+        char head[4096];
+        file.read(head, sizeof(head));
+        if (gzip_magic(head, file.gcount())) {
+            open_compressed(fname);
+            return;
+        }
+        compressed = false;
+        detect_format(head, file.gcount());
+        file.clear();
+        
+        LineIndex idx;
+        std::string idx_path = size >= INDEX_MIN_SIZE ? cache_path(fname, ".idx") : "";
+        size_t chunks = 0;
+        if (!idx_path.empty() && load_index(idx_path, idx)) {
+            chunks = trusted_chunks(file, idx, size, mtime);
+        }
 
         lines.clear();
-        lines.reserve(4096);
-        std::string buffer;
-        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
-
-        size_t start = 0;
-        for (size_t i = 0; i <= buffer.size(); ++i) {
-            if (i == buffer.size() || buffer[i] == '\n') {
-                std::string line = buffer.substr(start, i - start);
-                if (line.length() > MAX_LINE_LENGTH)
-                    line.resize(MAX_LINE_LENGTH);
-                lines.push_back(std::move(line));
-                start = i + 1;
+        if (chunks > 0 && !load_chunks(fname, idx, chunks, size)) {
+            chunks = 0;
+        }
+        if (chunks > 0 && chunks == idx.offsets.size()) {
+            idx_path.clear();
+        } else {
+            idx.offsets.resize(chunks + 1);
+            idx.offsets[0] = 0;
+            lines.resize(chunks * INDEX_STRIDE);
+            lines.reserve(std::max<uint64_t>(4096, lines.size() + (size - idx.offsets.back()) / 32));
+            
+            uint64_t offset = idx.offsets.back();
+            file.clear();
+            file.seekg(offset);
+            
+            std::vector<char> block(1 << 20);
+            std::string line;
+            while (file.read(block.data(), block.size()) || file.gcount() > 0) {
+                const char* p = block.data();
+                const char* end = p + file.gcount();
+                while (const char* nl = (const char*)memchr(p, '\n', end - p)) {
+                    line.append(p, nl - p);
+                    offset += line.size() + 1;
+                    if (crlf && !line.empty() && line.back() == '\r') line.pop_back();
+                    if (line.length() > MAX_LINE_LENGTH)
+                        line.resize(MAX_LINE_LENGTH);
+                    lines.push_back(std::move(line));
+                    line.clear();
+                    if (lines.size() % INDEX_STRIDE == 0) idx.offsets.push_back(offset);
+                    p = nl + 1;
+                }
+                line.append(p, end - p);
+                if (file.eof()) break;
             }
+            if (line.length() > MAX_LINE_LENGTH)
+                line.resize(MAX_LINE_LENGTH);
+            lines.push_back(std::move(line));
         }
 
-        if (lines.empty())
-        lines.push_back("");
+        if (!idx_path.empty()) {
+            idx.size = size;
+            idx.mtime = mtime;
+            idx.line_count = lines.size();
+            idx.samples.resize(idx.offsets.size());
+            for (size_t i = chunks; i < idx.offsets.size(); i++) {
+                idx.samples[i] = sample_at(file, idx.offsets[i], size);
+            }
+            idx.tail_sample = sample_at(file, size, size);
+            save_index(idx_path, idx);
+        }
 
         file.close();
+        if (bom) lines[0] = lines[0].str().substr(bom_length(lines[0].str().data(), lines[0].length()));
         filename = fname;
+        grammar = Grammar::for_file(fname, lines[0]);
+        words.reset();
+        reshaped(0);
+        record_disk();
         cursor_x = cursor_y = top_line = 0;
         modified = false;
+        redraw = true;
         msg("File loaded: " + fname);
     }
     
-    void adj() {
-        std::vector<std::string> display_lines;
-        for (const auto& line : lines) {
-            auto wrapped = wrap_line(line, term_cols - 7);
-            display_lines.insert(display_lines.end(), wrapped.begin(), wrapped.end());
-        }
+    int cursor_row(int& seg_start) {
+        int width = term_cols - 7;
+        row_index.sync(lines, width);
+        int seg = std::min(cursor_x > 0 ? (cursor_x - 1) / width : 0, row_index.rows_of(cursor_y) - 1);
+        seg_start = seg * width;
+        return row_index.before(cursor_y) + seg;
+    }
+    
+    int prev_line(int y) {
+        int seg;
+        row_index.sync(lines, term_cols - 7);
+        return y > 0 ? (int)row_index.line_at(row_index.before(y) - 1, seg) : y;
+    }
+    
+    int next_line(int y) {
+        int seg;
+        row_index.sync(lines, term_cols - 7);
+        size_t next = row_index.line_at(row_index.before(y + 1), seg);
+        return next < lines.size() ? (int)next : y;
+    }
+    
+    void reveal(int y) {
+        row_index.sync(lines, term_cols - 7);
+        while (row_index.rows_of(y) == 0) {
+            int seg;
+            size_t header = row_index.line_at(row_index.before(y) - 1, seg);
+            lines[header].set_fold(0);
+            row_index.reshape(header);
+            row_index.sync(lines, term_cols - 7);
+            redraw = true;
+        }
+    }
+    
+    int fold_end(int y) {
+        const GrammarSpec* spec = grammar ? grammar->spec : nullptr;
+        int x = brackets.unmatched_open(lines, spec, y), my, mx;
+        if (x >= 0 && brackets.match(lines, spec, y, x, my, mx) && my > y + 1) return my - 1;
         
-        int cursor_display_line = 0;
-        for (int i = 0; i < cursor_y; i++) {
-            auto wrapped = wrap_line(lines[i], term_cols - 7);
-            cursor_display_line += wrapped.size();
+        int base = lines[y].str().find_first_not_of(" \t");
+        if (base < 0) return y;
+        int end = y;
+        for (int z = y + 1; z < (int)lines.size(); z++) {
+            int depth = lines[z].str().find_first_not_of(" \t");
+            if (depth < 0) continue;
+            if (depth <= base) break;
+            end = z;
         }
-        
-        auto current_wrapped = wrap_line(lines[cursor_y], term_cols - 7);
-        int chars_before_cursor = 0;
-        for (int i = 0; i < (int)current_wrapped.size(); i++) {
-            if (chars_before_cursor + (int)current_wrapped[i].length() >= cursor_x) {
-                cursor_display_line += i;
-                break;
+        return end;
+    }
+    
+    void toggle_fold() {
+        Line& line = lines[cursor_y];
+        if (line.folded()) {
+            line.set_fold(0);
+            msg("Unfolded");
+        } else {
+            int end = fold_end(cursor_y);
+            if (end <= cursor_y) {
+                msg("Nothing to fold here");
+                return;
             }
-            chars_before_cursor += current_wrapped[i].length();
+            line.set_fold(end - cursor_y);
+            msg("Folded " + std::to_string(end - cursor_y) + " lines");
         }
+        row_index.reshape(cursor_y);
+        redraw = true;
+    }
+    
+    void adj() {
+        reveal(cursor_y);
+        int chars_before_cursor;
+        int cursor_display_line = cursor_row(chars_before_cursor);
+        int total_rows = row_index.total();
         
         if (cursor_display_line < top_line) {
             top_line = cursor_display_line;
@@ -865,9 +3417,172 @@ public:
             top_line = cursor_display_line - visible_lines + 1;
         }
         if (top_line < 0) top_line = 0;
-        if (top_line > (int)display_lines.size() - visible_lines) {
-            top_line = std::max(0, (int)display_lines.size() - visible_lines);
+        if (top_line > total_rows - visible_lines) {
+            top_line = std::max(0, total_rows - visible_lines);
+        }
+    }
+    
+    bool selection(int& y1, int& x1, int& y2, int& x2) {
+        if (sel_y < 0) return false;
+        if (sel_y >= (int)lines.size()) {
+            sel_y = -1;
+            return false;
+        }
+        int sx = std::min(sel_x, (int)lines[sel_y].length());
+        if (sel_y < cursor_y || (sel_y == cursor_y && sx <= cursor_x)) {
+            y1 = sel_y; x1 = sx; y2 = cursor_y; x2 = cursor_x;
+        } else {
+            y1 = cursor_y; x1 = cursor_x; y2 = sel_y; x2 = sx;
+        }
+        return true;
+    }
+    
+    bool block_rect(int& y1, int& x1, int& y2, int& x2) {
+        if (sel_y < 0) return false;
+        if (sel_y >= (int)lines.size()) {
+            sel_y = -1;
+            return false;
+        }
+        y1 = std::min(sel_y, cursor_y);
+        y2 = std::max(sel_y, cursor_y);
+        x1 = std::min(sel_x, cursor_x);
+        x2 = std::max(sel_x, cursor_x);
+        return true;
+    }
+    
+    void block(bool on) {
+        block_mode = on;
+        if (on) {
+            sel_x = cursor_x;
+            sel_y = cursor_y;
+            sel_shift = false;
+            msg("Block mode: move to span lines/columns, type to edit all of them");
+        } else {
+            sel_y = -1;
+            cursor_x = std::min(cursor_x, (int)lines[cursor_y].length());
+            msg("Block mode off");
+        }
+        redraw = true;
+    }
+    
+    void block_edit(char ch) {
+        int y1, x1, y2, x2;
+        if (!block_rect(y1, x1, y2, x2)) return;
+        bool erase = ch == 127 || ch == 8;
+        if (erase && x1 == x2 && x1 == 0) return;
+        
+        save_state();
+        int from = (erase && x1 == x2) ? x1 - 1 : x1;
+        int touched = 0;
+        for (int y = y1; y <= y2; y++) {
+            if ((int)lines[y].length() < from) continue;
+            if (!erase && lines[y].length() >= MAX_LINE_LENGTH - 1) continue;
+            std::string& line = lines[y].mut();
+            line.erase(from, x2 - from);
+            if (!erase) line.insert(from, 1, ch);
+            edited(y);
+            touched++;
+        }
+        cursor_x = sel_x = erase ? from : from + 1;
+        modified = true;
+        msg("Block edit applied to " + std::to_string(touched) + " lines");
+    }
+    
+    void delete_selection() {
+        int y1, x1, y2, x2;
+        if (!selection(y1, x1, y2, x2)) return;
+        std::string joined = lines[y1].str().substr(0, x1) + lines[y2].str().substr(x2);
+        int fold = lines[y2].folded();
+        erase_lines(y1 + 1, y2 + 1);
+        int marks = lines[y1].marks();
+        lines[y1] = std::move(joined);
+        lines[y1].set_fold(fold);
+        lines[y1].set_marks(marks);
+        if (y1 == y2) edited(y1);
+        else {
+            mark_changed(y1);
+            reshaped(y1);
+        }
+        cursor_y = y1;
+        cursor_x = x1;
+        sel_y = -1;
+    }
+    
+    void copy_region(bool cut) {
+        int y1, x1, y2, x2;
+        clipboard = Clip();
+        if (!selection(y1, x1, y2, x2)) {
+            clipboard.lines.assign(1, lines[cursor_y]);
+            clipboard.lines[0].set_fold(0);
+            clipboard.whole_lines = true;
+            if (cut) {
+                save_state();
+                erase_lines(cursor_y, cursor_y + 1);
+                reshaped(cursor_y);
+                if (cursor_y >= (int)lines.size()) cursor_y = lines.size() - 1;
+                cursor_x = 0;
+                modified = true;
+            }
+            msg(cut ? "Line cut to clipboard" : "Line copied to clipboard");
+            return;
+        }
+        
+        clipboard.lines.assign(lines.begin() + y1, lines.begin() + y2 + 1);
+        for (auto& line : clipboard.lines) line.set_fold(0);
+        clipboard.head = x1;
+        clipboard.tail = x2;
+        if (cut) {
+            save_state();
+            delete_selection();
+            modified = true;
+        }
+        sel_y = -1;
+        redraw = true;
+        msg(std::to_string(y2 - y1 + 1) + (cut ? " lines cut to clipboard" : " lines copied to clipboard"));
+    }
+    
+    void paste() {
+        if (clipboard.lines.empty()) {
+            msg("Clipboard is empty");
+            return;
+        }
+        save_state();
+        delete_selection();
+        
+        const auto& clip = clipboard.lines;
+        size_t n = clip.size();
+        if (clipboard.whole_lines) {
+            lines.insert(lines.begin() + cursor_y, clip.begin(), clip.end());
+            mark_added(cursor_y, n);
+            reshaped(cursor_y);
+            cursor_y += n;
+            cursor_x = 0;
+        } else {
+            std::string left = lines[cursor_y].str().substr(0, cursor_x);
+            std::string right = lines[cursor_y].str().substr(cursor_x);
+            int fold = lines[cursor_y].folded(), marks = lines[cursor_y].marks();
+            if (n == 1) {
+                lines[cursor_y] = left + clip[0].str().substr(clipboard.head, clipboard.tail - clipboard.head) + right;
+                lines[cursor_y].set_fold(fold);
+                lines[cursor_y].set_marks(marks);
+                edited(cursor_y);
+                cursor_x += clipboard.tail - clipboard.head;
+            } else {
+                std::string last = clip[n - 1].str().substr(0, clipboard.tail);
+                lines[cursor_y] = left + clip[0].str().substr(clipboard.head);
+                lines[cursor_y].set_marks(marks);
+                mark_changed(cursor_y);
+                lines.insert(lines.begin() + cursor_y + 1, clip.begin() + 1, clip.end() - 1);
+                lines.insert(lines.begin() + cursor_y + n - 1, Line(last + right));
+                lines[cursor_y + n - 1].set_fold(fold);
+                mark_added(cursor_y + 1, n - 1);
+                reshaped(cursor_y);
+                cursor_y += n - 1;
+                cursor_x = last.length();
+            }
         }
+        modified = true;
+        msg("Pasted " + std::to_string(n) + " lines");
     }
     
     void find_text() {
@@ -911,7 +3626,7 @@ public:
         int start_col = (find_line == cursor_y && find_col < cursor_x) ? cursor_x + 1 : cursor_x;
         
         for (int i = start_line; i < (int)lines.size(); i++) {
-            size_t pos = lines[i].find(search_term, (i == start_line) ? start_col : 0);
+            size_t pos = lines[i].str().find(search_term, (i == start_line) ? start_col : 0);
             if (pos != std::string::npos) {
                 cursor_y = i;
                 cursor_x = pos;
@@ -924,7 +3639,7 @@ public:
         }
         
         for (int i = 0; i < start_line; i++) {
-            size_t pos = lines[i].find(search_term);
+            size_t pos = lines[i].str().find(search_term);
             if (pos != std::string::npos) {
                 cursor_y = i;
                 cursor_x = pos;
@@ -981,63 +3696,581 @@ public:
         }
     }
     
-    char get_char() {
+    void watch() {
+#ifdef __linux__
+        if (watch_fd < 0) watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd < 0) return;
+        if (watch_wd >= 0) inotify_rm_watch(watch_fd, watch_wd);
+        watch_wd = inotify_add_watch(watch_fd, filename.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+    }
+    
+    void unwatch() {
+#ifndef _WIN32
+        if (watch_fd >= 0) close(watch_fd);
+#endif
+        watch_fd = watch_wd = -1;
+    }
+    
+    void follow(bool on) {
 #ifdef _WIN32
-        return _getch();
+        following = false;
+        msg("Follow mode is not supported on this platform");
 #else
-        char ch;
-        read(STDIN_FILENO, &ch, 1);
-        return ch;
+        if (hex_mode || compressed) {
+            msg(hex_mode ? "Follow mode is not available in hex view" : "Follow mode is not available for compressed files");
+            return;
+        }
+        following = on;
+        if (!following) {
+            unwatch();
+            msg("Follow mode off");
+            return;
+        }
+        watch();
+        follow_update();
+        cursor_y = lines.size() - 1;
+        cursor_x = lines[cursor_y].length();
+        adj();
+        msg("Following " + filename + " (^T to stop)");
+#endif
+    }
+    
+    void follow_update() {
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0) return;
+        uint64_t size = st.st_size;
+        bool pinned = cursor_y == (int)lines.size() - 1;
+        
+        if ((uint64_t)st.st_ino != follow_ino || size < follow_offset) {
+            reset_file_state();
+            open_file(filename);
+            watch();
+            cursor_y = lines.size() - 1;
+            cursor_x = lines[cursor_y].length();
+            adj();
+            msg("File was replaced on disk, reloaded");
+            return;
+        }
+        if (size == follow_offset) return;
+        
+        std::ifstream file(filename, std::ios::in | std::ios::binary);
+        std::string chunk(size - follow_offset, '\0');
+        file.seekg(follow_offset);
+        file.read(&chunk[0], chunk.size());
+        chunk.resize(file.gcount());
+        if (chunk.empty()) return;
+        follow_offset += chunk.size();
+        append_text(chunk);
+        
+        size_t chunked = 0;
+        for (const auto& chunk : disk_chunks) chunked += chunk.lines;
+        if (!disk_chunks.empty()) {
+            chunked -= disk_chunks.back().lines;
+            disk_chunks.pop_back();
+        }
+        DiskChunks more = chunk_lines(lines, std::min(chunked, lines.size()));
+        disk_chunks.insert(disk_chunks.end(), more.begin(), more.end());
+        disk_size = follow_offset;
+        disk_mtime = st.st_mtime;
+        
+        if (pinned) {
+            cursor_y = lines.size() - 1;
+            cursor_x = lines[cursor_y].length();
+            adj();
+        }
+    }
+    
+    void append_text(const std::string& chunk) {
+        int first = lines.size() - 1;
+        size_t start = 0;
+        for (size_t nl = chunk.find('\n'); nl != std::string::npos; nl = chunk.find('\n', start)) {
+            std::string& last = lines.back().mut();
+            last.append(chunk, start, nl - start);
+            if (crlf && !last.empty() && last.back() == '\r') last.pop_back();
+            if (last.length() > MAX_LINE_LENGTH)
+                last.resize(MAX_LINE_LENGTH);
+            lines.emplace_back();
+            start = nl + 1;
+        }
+        std::string& last = lines.back().mut();
+        last.append(chunk, start, std::string::npos);
+        if (last.length() > MAX_LINE_LENGTH)
+            last.resize(MAX_LINE_LENGTH);
+        lines.back().settle();
+        reshaped(first);
+        
+        size_t nl = chunk.find('\n');
+        for (auto& state : undo_stack) {
+            Line& tail = state.lines.back();
+            std::string& text = tail.mut();
+            text.append(chunk, 0, nl);
+            if (nl != std::string::npos && crlf && !text.empty() && text.back() == '\r') text.pop_back();
+            if (text.length() > MAX_LINE_LENGTH)
+                text.resize(MAX_LINE_LENGTH);
+            tail.settle();
+            if (nl != std::string::npos) state.lines.insert(state.lines.end(), lines.begin() + first + 1, lines.end());
+            state.keep_head = SIZE_MAX;
+        }
+        if (repaint_line < 0 || first < repaint_line) repaint_line = first;
+    }
+    
+    void stream_update() {
+        std::string chunk;
+        bool eof;
+        {
+            stream_state->wake.drain();
+            std::lock_guard<std::mutex> guard(stream_state->lock);
+            chunk.swap(stream_state->data);
+            eof = stream_state->eof;
+        }
+        if (!chunk.empty()) {
+            bool first = lines.size() == 1 && lines[0].empty();
+            if (first) detect_format(chunk.data(), chunk.size());
+            append_text(first ? chunk.substr(bom_length(chunk.data(), chunk.size())) : chunk);
+            if (first) grammar = Grammar::for_file(compressed ? filename.substr(0, filename.rfind('.')) : filename, lines[0]);
+            if (!compressed) modified = true;
+        }
+        std::string count = std::to_string(lines.size()) + " lines";
+        if (eof) {
+            int status = 0;
+            stream_thread.join();
+#ifndef _WIN32
+            if (stream_state->child > 0) waitpid(stream_state->child, &status, 0);
+#endif
+            stream_state.reset();
+            if (!compressed) msg("Read " + count + " from stdin");
+            else if (status != 0) {
+                partial = true;
+                msg("gzip failed: " + filename + " is truncated or corrupt (" + count + " read)");
+            }
+            else msg("Inflated " + count + " from " + filename);
+            if (compressed) record_disk();
+        } else {
+            msg((compressed ? "Inflating " + filename : std::string("Reading stdin")) + "... " + count);
+        }
+    }
+    
+    bool wait_key() {
+#ifdef _WIN32
+        return true;
+#else
+        if (!typeahead.empty() || (!following && !session_dirty && !stream_state && !search_state)) return true;
+        
+        bool watching = following && watch_fd >= 0 && watch_wd >= 0;
+        int timeout = following && !watching ? 1000 : -1;
+        if (session_dirty) timeout = timeout < 0 ? SESSION_IDLE : std::min(timeout, SESSION_IDLE);
+        struct pollfd fds[4] = {{STDIN_FILENO, POLLIN, 0}, {watching ? watch_fd : -1, POLLIN, 0},
+                                {stream_state ? stream_state->wake.fds[0] : -1, POLLIN, 0},
+                                {search_state ? search_state->wake.fds[0] : -1, POLLIN, 0}};
+        int ready = poll(fds, 4, timeout);
+        if (ready > 0 && (fds[0].revents & POLLIN)) return true;
+        if (ready == 0 && session_dirty) save_session();
+        if (ready > 0 && (fds[2].revents & POLLIN)) stream_update();
+        if (ready > 0 && (fds[3].revents & POLLIN)) search_update();
+        if (!following) return false;
+        
+#ifdef __linux__
+        if (watching && (fds[1].revents & POLLIN)) {
+            char buf[4096];
+            ssize_t n;
+            while ((n = read(watch_fd, buf, sizeof(buf))) > 0) {
+                for (ssize_t off = 0; off < n; ) {
+                    struct inotify_event* ev = (struct inotify_event*)(buf + off);
+                    if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) watch_wd = -1;
+                    off += sizeof(struct inotify_event) + ev->len;
+                }
+            }
+        }
+#endif
+        follow_update();
+        return false;
+#endif
+    }
+    
+    bool read_key(char& ch) {
+        if (playing) {
+            if (play_pos >= macro.size()) return false;
+            ch = macro[play_pos++];
+            return true;
+        }
+        if (!typeahead.empty()) {
+            ch = typeahead[0];
+            typeahead.erase(0, 1);
+        } else {
+#ifdef _WIN32
+        ch = _getch();
+#else
+        if (read(STDIN_FILENO, &ch, 1) != 1) return false;
+#endif
+        }
+        if (recording) macro += ch;
+        return true;
+    }
+    
+    char focus_event() {
+#ifndef _WIN32
+        if (playing) return 0;
+        char seq[2];
+        int got = 0;
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        while (got < 2 && poll(&pfd, 1, 0) > 0 && read(STDIN_FILENO, &seq[got], 1) == 1) {
+            if (seq[got++] != '[') break;
+        }
+        if (got == 2 && (seq[1] == 'I' || seq[1] == 'O')) {
+            if (recording) macro.pop_back();
+            return seq[1];
+        }
+        typeahead.append(seq, got);
 #endif
+        return 0;
+    }
+    
+    char get_char() {
+        char ch;
+        while (read_key(ch)) {
+            if (ch != 27 || !focus_event()) return ch;
+        }
+        return 27;
+    }
+    
+    void quit() {
+        if (modified) {
+            msg("Warning: Unsaved changes! Press Ctrl+Q again to exit.");
+            static time_t last_quit = 0;
+            if (time(nullptr) - last_quit < 2) {
+                running = false;
+            }
+            last_quit = time(nullptr);
+        } else {
+            running = false;
+        }
+    }
+    
+    void record_macro() {
+        if (playing) return;
+        if (!recording) {
+            macro.clear();
+            recording = true;
+            msg("Recording macro (Ctrl+\\ to stop)");
+            return;
+        }
+        macro.pop_back();
+        recording = false;
+        msg("Macro recorded (" + std::to_string(macro.size()) + " keys)");
+    }
+    
+    bool prompt(const std::string& label, std::string& answer) {
+        msg(label);
+        drw();
+        while (true) {
+            char ch = get_char();
+            if (ch == '\r' || ch == '\n') return true;
+            if (ch == 27) return false;
+            if (ch == 127 || ch == 8) {
+                if (!answer.empty()) answer.pop_back();
+            } else if (ch >= 32 && ch <= 126 && answer.size() < 256) {
+                answer += ch;
+            }
+            msg(label + answer);
+            drw();
+        }
+    }
+    
+    void play_macro() {
+        if (playing) return;
+        if (recording) {
+            macro.pop_back();
+            msg("Cannot play a macro while recording it");
+            return;
+        }
+        if (macro.empty()) {
+            msg("No macro recorded");
+            return;
+        }
+        
+        std::string count;
+        if (!prompt("Play macro times: ", count)) {
+            msg("Playback cancelled");
+            return;
+        }
+        long times = count.empty() ? 1 : strtol(count.c_str(), nullptr, 10);
+        save_state();
+        playing = true;
+        long done = 0;
+        for (; done < times && running; done++) {
+            for (play_pos = 0; play_pos < macro.size() && running; ) inp();
+        }
+        playing = false;
+        suggestions.clear();
+        redraw = true;
+        msg("Macro played " + std::to_string(done) + " times");
+    }
+    
+    void replace_lines(size_t y1, size_t y2, Lines& result) {
+        save_state();
+        for (auto& line : result) line.set_fold(0);
+        if (result.size() == y2 - y1) {
+            std::move(result.begin(), result.end(), lines.begin() + y1);
+        } else {
+            lines.erase(lines.begin() + y1, lines.begin() + y2);
+            lines.insert(lines.begin() + y1, std::make_move_iterator(result.begin()), std::make_move_iterator(result.end()));
+        }
+        if (lines.empty()) lines.push_back("");
+        reshaped(y1);
+        sel_y = -1;
+        cursor_y = std::min<int>(cursor_y, lines.size() - 1);
+        cursor_x = 0;
+        modified = true;
+        redraw = true;
+    }
+    
+    void keep_lines(size_t y1, size_t y2, const std::vector<char>& keep) {
+        Lines kept;
+        int bits = 0;
+        for (size_t y = y1; y < y2; y++) {
+            const Line& line = lines[y];
+            if (keep[y - y1]) {
+                kept.push_back(line);
+                kept.back().set_marks(line.marks() | bits);
+                bits = 0;
+            } else {
+                bits |= line.marks() & MARK_ADDED ? line.marks() & MARK_REMOVED : MARK_REMOVED;
+            }
+        }
+        size_t removed = y2 - y1 - kept.size(), end = y1 + kept.size();
+        if (removed == 0) {
+            msg("No lines removed");
+            return;
+        }
+        replace_lines(y1, y2, kept);
+        if (bits) mark(end, bits);
+        msg("Removed " + std::to_string(removed) + " lines");
+    }
+    
+    void sort_lines(size_t y1, size_t y2, int column, bool numeric, bool reverse) {
+        size_t n = y2 - y1;
+        std::vector<SortKey> keys(n);
+        parallel_for((n + 65535) / 65536, [&](size_t t) {
+            for (size_t i = t * 65536; i < std::min(n, (t + 1) * 65536); i++) keys[i] = sort_key(lines[y1 + i], i, column, numeric);
+        });
+        parallel_sort(keys, [numeric, reverse](const SortKey& a, const SortKey& b) {
+            int c = compare_keys(a, b, numeric);
+            if (c) return reverse ? c > 0 : c < 0;
+            return a.index < b.index;
+        });
+        Lines sorted;
+        sorted.reserve(n);
+        size_t moved = 0;
+        for (size_t i = 0; i < n; i++) {
+            sorted.push_back(lines[y1 + keys[i].index]);
+            if (keys[i].index == i) continue;
+            if (!(sorted.back().marks() & MARK_ADDED)) sorted.back().set_marks(sorted.back().marks() | MARK_CHANGED);
+            moved++;
+        }
+        if (moved == 0) {
+            msg("Already sorted");
+            return;
+        }
+        keys = std::vector<SortKey>();
+        replace_lines(y1, y2, sorted);
+        msg("Sorted " + std::to_string(n) + " lines");
+    }
+    
+    void unique_lines(size_t y1, size_t y2) {
+        size_t n = y2 - y1;
+        std::vector<std::pair<uint64_t, uint32_t>> items(n);
+        parallel_for((n + 65535) / 65536, [&](size_t t) {
+            for (size_t i = t * 65536; i < std::min(n, (t + 1) * 65536); i++) {
+                const std::string& text = lines[y1 + i];
+                items[i] = {line_hash(text.data(), text.size()), (uint32_t)i};
+            }
+        });
+        parallel_sort(items, std::less<std::pair<uint64_t, uint32_t>>());
+        std::vector<char> keep(n, 1);
+        for (size_t i = 0; i < n; ) {
+            size_t j = i + 1;
+            while (j < n && items[j].first == items[i].first) j++;
+            for (size_t a = i + 1; a < j; a++) {
+                for (size_t b = i; b < a; b++) {
+                    if (keep[items[b].second] && lines[y1 + items[a].second].str() == lines[y1 + items[b].second].str()) {
+                        keep[items[a].second] = 0;
+                        break;
+                    }
+                }
+            }
+            i = j;
+        }
+        keep_lines(y1, y2, keep);
+    }
+    
+    void filter_lines(size_t y1, size_t y2, const std::string& pattern, bool matching) {
+        std::regex re;
+        try {
+            re.assign(pattern, std::regex::ECMAScript | std::regex::optimize);
+        } catch (const std::regex_error&) {
+            msg("Invalid pattern: " + pattern);
+            return;
+        }
+        size_t n = y2 - y1;
+        std::vector<char> keep(n);
+        parallel_for((n + 65535) / 65536, [&](size_t t) {
+            for (size_t i = t * 65536; i < std::min(n, (t + 1) * 65536); i++) {
+                keep[i] = std::regex_search(lines[y1 + i].str(), re) == matching;
+            }
+        });
+        keep_lines(y1, y2, keep);
+    }
+    
+    void line_command() {
+        size_t y1 = 0, y2 = lines.size();
+        int sy1, sx1, sy2, sx2;
+        if (selection(sy1, sx1, sy2, sx2)) {
+            y1 = sy1;
+            y2 = sx2 == 0 && sy2 > sy1 ? sy2 : sy2 + 1;
+        } else if (y2 > 1 && lines.back().empty()) {
+            y2--;
+        }
+        
+        msg("Lines: s)ort n)umeric k)ey column u)nique g)keep v)drop matching (S/N reverse)");
+        drw();
+        char op = get_char();
+        std::string answer;
+        if (op == 's' || op == 'S' || op == 'n' || op == 'N') {
+            sort_lines(y1, y2, 1, op == 'n' || op == 'N', op == 'S' || op == 'N');
+        } else if (op == 'k' || op == 'K') {
+            if (!prompt("Key column (e.g. 3 or 3n): ", answer)) {
+                msg("Sort cancelled");
+                return;
+            }
+            int column = atoi(answer.c_str());
+            if (column < 1) {
+                msg("Invalid column");
+                return;
+            }
+            sort_lines(y1, y2, column, answer.find('n') != std::string::npos, op == 'K');
+        } else if (op == 'u') {
+            unique_lines(y1, y2);
+        } else if (op == 'g' || op == 'v') {
+            if (!prompt(op == 'g' ? "Keep lines matching regex: " : "Delete lines matching regex: ", answer) || answer.empty()) {
+                msg("Filter cancelled");
+                return;
+            }
+            filter_lines(y1, y2, answer, op == 'g');
+        } else {
+            msg("Cancelled");
+        }
     }
     
     void inp() {
-        char ch = get_char();
+        char ch;
+        if (!read_key(ch)) {
+            ch = 27;
+        } else if (ch == 27) {
+            char focus = focus_event();
+            if (focus == 'I') reload_changed();
+            if (focus) return;
+        }
+        session_dirty = true;
+        
+        if (show_diff) {
+            diff_key(ch);
+            return;
+        }
+        
+        if (show_results) {
+            results_key(ch);
+            return;
+        }
         
-        if (show_guide || show_credits) {
-            show_guide = show_credits = false;
+        if (show_guide || show_credits || show_memory) {
+            show_guide = show_credits = show_memory = false;
+            redraw = true;
             return;
         }
         
+        if (hex_mode) {
+            hex_inp(ch);
+            return;
+        }
+        
+        if (block_mode && ch != 27 && ch != 127 && ch != 8 && !(ch >= 32 && ch <= 126)) {
+            block(false);
+            if (ch == 11 || ch == '\n' || ch == '\r') {
+                adj();
+                return;
+            }
+        }
+        
         if (ch == 27) {
             char seq[3];
+            bool shift = false;
+            std::string params;
 #ifdef _WIN32
             if (_kbhit()) {
                 seq[0] = _getch();
                 if (seq[0] == '[' && _kbhit()) {
                     seq[1] = _getch();
 #else
-            if (read(STDIN_FILENO, seq, 2) == 2 && seq[0] == '[') {
+            if (read_key(seq[0]) && read_key(seq[1]) && seq[0] == '[') {
+                if (seq[1] >= '0' && seq[1] <= '9') {
+                    params.assign(1, seq[1]);
+                    while (read_key(seq[1]) && (seq[1] < 0x40 || seq[1] > 0x7e)) {
+                        params += seq[1];
+                    }
+                    shift = params == "1;2";
+                }
 #endif
+                    if (seq[1] >= 'A' && seq[1] <= 'D') {
+                        if (shift && sel_y < 0) {
+                            sel_x = cursor_x;
+                            sel_y = cursor_y;
+                            sel_shift = true;
+                        } else if (!shift && sel_y >= 0 && sel_shift && !block_mode) {
+                            sel_y = -1;
+                            redraw = true;
+                        }
+                        if (sel_y >= 0 || shift) redraw = true;
+                    }
                     switch (seq[1]) {
                         case 'A':
                             if (cursor_y > 0) {
-                                cursor_y--;
-                                cursor_x = std::min(cursor_x, (int)lines[cursor_y].length());
+                                cursor_y = prev_line(cursor_y);
+                                if (!block_mode) cursor_x = std::min(cursor_x, (int)lines[cursor_y].length());
                             }
                             break;
                         case 'B':
                             if (cursor_y < (int)lines.size() - 1) {
-                                cursor_y++;
-                                cursor_x = std::min(cursor_x, (int)lines[cursor_y].length());
+                                cursor_y = next_line(cursor_y);
+                                if (!block_mode) cursor_x = std::min(cursor_x, (int)lines[cursor_y].length());
                             }
                             break;
                         case 'C':
-                            if (cursor_x < (int)lines[cursor_y].length()) {
+                            if (block_mode) {
+                                if (cursor_x < MAX_LINE_LENGTH - 1) cursor_x++;
+                            } else if (cursor_x < (int)lines[cursor_y].length()) {
                                 cursor_x++;
-                            } else if (cursor_y < (int)lines.size() - 1) {
-                                cursor_y++;
+                            } else if (next_line(cursor_y) != cursor_y) {
+                                cursor_y = next_line(cursor_y);
                                 cursor_x = 0;
                             }
                             break;
                         case 'D':
-                            if (cursor_x > 0) {
+                            if (block_mode) {
+                                if (cursor_x > 0) cursor_x--;
+                            } else if (cursor_x > 0) {
                                 cursor_x--;
                             } else if (cursor_y > 0) {
-                                cursor_y--;
+                                cursor_y = prev_line(cursor_y);
                                 cursor_x = lines[cursor_y].length();
                             }
                             break;
+                        case '~':
+                            if (params == "15") diff_disk();
+                            else if (params == "17") next_change();
+                            else if (params == "18") line_command();
+                            else if (params == "19") search_files();
+                            break;
                     }
                     adj();
 #ifdef _WIN32
@@ -1046,45 +4279,62 @@ public:
 #else
             }
 #endif
+        } else if (block_mode && (ch == 127 || ch == 8 || (ch >= 32 && ch <= 126))) {
+            block_edit(ch);
+        } else if (ch == 11) {
+            block(true);
         } else if (ch == 127 || ch == 8) {
-            if (cursor_x > 0) {
+            if (sel_y >= 0) {
                 save_state();
-                lines[cursor_y].erase(cursor_x - 1, 1);
+                delete_selection();
+                modified = true;
+            } else if (cursor_x > 0) {
+                save_state();
+                lines[cursor_y].mut().erase(cursor_x - 1, 1);
+                edited(cursor_y);
                 cursor_x--;
                 modified = true;
             } else if (cursor_y > 0) {
                 save_state();
                 cursor_x = lines[cursor_y - 1].length();
-                lines[cursor_y - 1] += lines[cursor_y];
-                lines.erase(lines.begin() + cursor_y);
+                lines[cursor_y - 1].mut() += lines[cursor_y].str();
+                lines[cursor_y - 1].set_fold(lines[cursor_y].folded());
+                mark_changed(cursor_y - 1);
+                erase_lines(cursor_y, cursor_y + 1);
+                reshaped(cursor_y - 1);
                 cursor_y--;
                 modified = true;
             }
         } else if (ch == '\n' || ch == '\r') {
             save_state();
-            std::string rest = lines[cursor_y].substr(cursor_x);
-            lines[cursor_y] = lines[cursor_y].substr(0, cursor_x);
+            delete_selection();
+            std::string rest = lines[cursor_y].str().substr(cursor_x);
+            int marks = lines[cursor_y].marks();
+            if (!rest.empty()) lines[cursor_y].mut().erase(cursor_x);
             lines.insert(lines.begin() + cursor_y + 1, rest);
+            lines[cursor_y + 1].set_fold(lines[cursor_y].folded());
+            lines[cursor_y].set_fold(0);
+            if (cursor_x == 0 && !rest.empty()) {
+                lines[cursor_y].set_marks(MARK_ADDED | (marks & MARK_REMOVED));
+                lines[cursor_y + 1].set_marks(marks & ~MARK_REMOVED);
+            } else {
+                if (!rest.empty()) mark_changed(cursor_y);
+                lines[cursor_y + 1].set_marks(MARK_ADDED);
+            }
+            reshaped(cursor_y);
             cursor_y++;
             cursor_x = 0;
             modified = true;
         } else if (ch == 17) {
-            if (modified) {
-                msg("Warning: Unsaved changes! Press Ctrl+Q again to exit.");
-                static time_t last_quit = 0;
-                if (time(nullptr) - last_quit < 2) {
-                    running = false;
-                }
-                last_quit = time(nullptr);
-            } else {
-                running = false;
-            }
+            quit();
         } else if (ch == 19) {
             sav();
         } else if (ch == 7) {
             show_guide = true;
         } else if (ch == 14) {
             show_credits = true;
+        } else if (ch == 5) {
+            show_memory = true;
         } else if (ch == 21) {
             undo();
         } else if (ch == 6) {
@@ -1092,68 +4342,220 @@ public:
         } else if (ch == 12) {
             goto_line();
         } else if (ch == 24) {
-            if (cursor_y < (int)lines.size()) {
-                save_state();
-                clipboard = lines[cursor_y];
-                lines.erase(lines.begin() + cursor_y);
-                if (lines.empty()) lines.push_back("");
-                if (cursor_y >= (int)lines.size()) cursor_y = lines.size() - 1;
-                cursor_x = 0;
-                modified = true;
-                msg("Line cut to clipboard");
+            copy_region(true);
+        } else if (ch == 3) {
+            copy_region(false);
+        } else if (ch == 22) {
+            paste();
+        } else if (ch == 1) {
+            sel_x = sel_y = 0;
+            sel_shift = false;
+            cursor_y = lines.size() - 1;
+            cursor_x = lines[cursor_y].length();
+            redraw = true;
+            msg("Selected all (" + std::to_string(lines.size()) + " lines)");
+        } else if (ch == 2) {
+            if (sel_y >= 0) {
+                sel_y = -1;
+                msg("Mark unset");
+            } else {
+                sel_x = cursor_x;
+                sel_y = cursor_y;
+                sel_shift = false;
+                msg("Mark set");
             }
+            redraw = true;
         } else if (ch == 4) {
             if (!lines.empty() && cursor_y < (int)lines.size()) {
                 save_state();
-                lines.erase(lines.begin() + cursor_y);
-                if (lines.empty()) lines.push_back("");
+                sel_y = -1;
+                erase_lines(cursor_y, cursor_y + 1);
+                reshaped(cursor_y);
                 if (cursor_y >= (int)lines.size()) cursor_y = lines.size() - 1;
                 cursor_x = 0;
                 modified = true;
                 msg("Line deleted");
             }
+        } else if (ch == 20) {
+            follow(!following);
+        } else if (ch == 29) {
+            jump_bracket();
+        } else if (ch == 16) {
+            toggle_fold();
+        } else if (ch == 0) {
+            complete();
+        } else if (ch == 28) {
+            record_macro();
+        } else if (ch == 31) {
+            play_macro();
         } else if (ch == 9) {
             insert_mode = !insert_mode;
             msg(insert_mode ? "Insert mode" : "Overwrite mode");
         } else if (ch >= 32 && ch <= 126) {
             if (lines[cursor_y].length() < MAX_LINE_LENGTH - 1) {
                 save_state();
+                delete_selection();
+                std::string& line = lines[cursor_y].mut();
                 if (insert_mode) {
-                    lines[cursor_y].insert(cursor_x, 1, ch);
+                    line.insert(cursor_x, 1, ch);
                 } else {
-                    if (cursor_x < (int)lines[cursor_y].length()) {
-                        lines[cursor_y][cursor_x] = ch;
+                    if (cursor_x < (int)line.length()) {
+                        line[cursor_x] = ch;
                     } else {
-                        lines[cursor_y] += ch;
+                        line += ch;
                     }
                 }
+                edited(cursor_y);
                 cursor_x++;
                 modified = true;
             }
         }
         
+        if (ch != 0) {
+            bool word_key = ch == 127 || ch == 8 || is_word_char(ch, grammar ? grammar->spec : nullptr);
+            if (word_key && !block_mode && sel_y < 0 && !playing) suggest();
+            else suggestions.clear();
+        }
         adj();
     }
     
     void run() {
         while (running) {
             drw();
-            inp();
+            if (wait_key()) inp();
+            trim_memory();
         }
+        save_session();
     }
     
-    void load_file(const std::string& fname) {
-        filename = fname;
+    void reset_file_state() {
+        undo_stack.clear();
+        sel_y = -1;
+        block_mode = false;
+        suggestions.clear();
+        complete_pick = -1;
+        find_line = find_col = -1;
+        drawn_marks.clear();
+        partial = false;
+        redraw = true;
+    }
+    
+    void load_file(const std::string& fname, bool hex = false) {
+        close_hex();
+        reset_file_state();
+        if ((hex || looks_binary(fname)) && file_exists(fname)) {
+            open_hex(fname);
+            return;
+        }
         open_file(fname);
+        if (!compressed) restore_session();
+        trim_memory();
+    }
+    
+    void open_compressed(const std::string& fname) {
+#ifdef _WIN32
+        msg("Compressed files are not supported on this platform");
+#else
+        int fds[2];
+        pid_t pid = -1;
+        if (cloexec_pipe(fds)) {
+            pid = run_gzip("-dc", -1, fds[1], fname.c_str());
+            close(fds[1]);
+            if (pid < 0) close(fds[0]);
+        }
+        if (pid < 0) {
+            msg("Cannot start gzip to read " + fname);
+            return;
+        }
+        
+        filename = fname;
+        lines = {""};
+        crlf = bom = false;
+        words.reset();
+        reshaped(0);
+        grammar = nullptr;
+        compressed = true;
+        record_disk();
+        cursor_x = cursor_y = top_line = 0;
+        modified = false;
+        redraw = true;
+        stream(fds[0]);
+        if (stream_state) stream_state->child = pid;
+        msg("Inflating " + fname + "...");
+#endif
+    }
+    
+    void stream(int fd) {
+#ifdef _WIN32
+        std::string text((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+        detect_format(text.data(), text.size());
+        append_text(text.substr(bom_length(text.data(), text.size())));
+        grammar = Grammar::for_file(filename, lines[0]);
+        modified = true;
+#else
+        stream_state = std::make_shared<StreamState>(fd);
+        if (!stream_state->wake.open()) {
+            stream_state.reset();
+            msg("Cannot read stdin");
+            return;
+        }
+        std::shared_ptr<StreamState> state = stream_state;
+        stream_thread = std::thread([state]() {
+            char buf[65536];
+            ssize_t n;
+            while ((n = read(state->fd, buf, sizeof(buf))) != 0) {
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                std::lock_guard<std::mutex> guard(state->lock);
+                state->data.append(buf, n);
+                state->wake.notify();
+            }
+            std::lock_guard<std::mutex> guard(state->lock);
+            state->eof = true;
+            state->wake.notify();
+        });
+        msg("Reading stdin...");
+#endif
+    }
+    
+    void cap_memory(int64_t mb) {
+        mem_cap = mb * 1024 * 1024;
     }
 };
 
 int main(int argc, char* argv[]) {
     try {
+        int doc_fd = -1;
+#ifndef _WIN32
+        if (argc > 1 && std::string(argv[argc - 1]) == "-") {
+            doc_fd = dup(STDIN_FILENO);
+            int tty = open("/dev/tty", O_RDWR);
+            if (tty < 0) {
+                std::cerr << "Error: no terminal for keyboard input" << std::endl;
+                return 1;
+            }
+            dup2(tty, STDIN_FILENO);
+            close(tty);
+        }
+#endif
         Editor editor;
         
-        if (argc > 1) {
-            editor.load_file(argv[1]);
+        int arg = 1;
+        bool follow = false, hex = false;
+        for (; arg < argc; arg++) {
+            std::string opt = argv[arg];
+            if (opt == "-f") follow = true;
+            else if (opt == "-x") hex = true;
+            else if (opt == "-m" && arg + 1 < argc) editor.cap_memory(atoll(argv[++arg]));
+            else break;
+        }
+        if (arg < argc && std::string(argv[arg]) == "-") {
+            editor.stream(doc_fd);
+        } else if (arg < argc) {
+            editor.load_file(argv[arg], hex);
+            if (follow) editor.follow(true);
         }
         
         editor.run();